@@ -45,8 +45,22 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Virtual address at which to receive page mappings containing client
+// requests.  The receive window behind it holds a whole request ring.
+#define FSREQVA		(DISKMAP - FSRING_NPAGES * PGSIZE)
+union Fsipc *fsreq = (union Fsipc *)FSREQVA;
+
+// Request rings set up by clients (see struct Fsring).  Ring i is mapped
+// at RINGVA + i * FSRING_NPAGES * PGSIZE.
+struct ClientRing {
+	envid_t cr_envid;	// Client, or 0 if free
+	uint32_t cr_sq_head;	// Next request to serve
+};
+
+#define MAXRINGS	64
+#define RINGVA		0xE0000000
+
+struct ClientRing ringtab[MAXRINGS];
 
 void
 serve_init(void)
@@ -176,6 +190,76 @@ try_open:
 	return 0;
 }
 
+static struct Fsring *
+ring_va(struct ClientRing *cr)
+{
+	return (struct Fsring *) (RINGVA + (cr - ringtab) * FSRING_NPAGES * PGSIZE);
+}
+
+// Whether cr is a ring whose client is still around.
+static bool
+ring_live(struct ClientRing *cr)
+{
+	return cr->cr_envid != 0 && pageref(ring_va(cr)) > 1;
+}
+
+// Unmap cr and make it free.
+static void
+ring_release(struct ClientRing *cr)
+{
+	int i;
+
+	for (i = 0; i < FSRING_NPAGES; i++)
+		sys_page_unmap(0, (char *) ring_va(cr) + i * PGSIZE);
+	cr->cr_envid = 0;
+}
+
+// Take the npages pages granted at fsreq as envid's request ring,
+// replacing any ring it had before.
+int
+serve_ring_setup(envid_t envid, int npages)
+{
+	struct ClientRing *cr = NULL;
+	struct PageBatch pb;
+	int i, r;
+
+	if (npages != FSRING_NPAGES)
+		return -E_INVAL;
+	for (i = 0; i < MAXRINGS; i++)
+		if (ringtab[i].cr_envid == envid)
+			ring_release(&ringtab[i]);
+	// Take a free ring, or one whose client is gone
+	for (i = 0; i < MAXRINGS && !cr; i++) {
+		if (ringtab[i].cr_envid != 0 && !ring_live(&ringtab[i]))
+			ring_release(&ringtab[i]);
+		if (ringtab[i].cr_envid == 0)
+			cr = &ringtab[i];
+	}
+	if (!cr)
+		return -E_MAX_OPEN;
+
+	// Move the pages out of the receive window, all but the first,
+	// which the next request replaces anyway
+	pagebatch_init(&pb);
+	for (i = 0; i < FSRING_NPAGES; i++) {
+		char *va = (char *) fsreq + i * PGSIZE;
+		if ((r = pagebatch_map(&pb, 0, va, 0,
+				       (char *) ring_va(cr) + i * PGSIZE,
+				       PTE_P|PTE_U|PTE_W)) < 0
+		    || (i > 0 && (r = pagebatch_unmap(&pb, 0, va)) < 0))
+			break;
+	}
+	if (r >= 0)
+		r = pagebatch_flush(&pb);
+	if (r < 0) {
+		ring_release(cr);
+		return r;
+	}
+	cr->cr_envid = envid;
+	cr->cr_sq_head = 0;
+	return 0;
+}
+
 // Set the size of req->req_fileid to req->req_size bytes, truncating
 // or extending the file as necessary.
 int
@@ -220,7 +304,8 @@ serve_read(envid_t envid, union Fsipc *ipc)
 		return err;
     }
     ssize_t count;
-    if ((count = file_read(o->o_file, ret->ret_buf, req->req_n, o->o_fd->fd_offset)) < 0) {
+    size_t n = MIN(req->req_n, sizeof(ret->ret_buf));
+    if ((count = file_read(o->o_file, ret->ret_buf, n, o->o_fd->fd_offset)) < 0) {
         return count;
     }
     o->o_fd->fd_offset += count;
@@ -245,7 +330,8 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 		return err;
     }
     ssize_t count;
-    if ((count = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset)) < 0) {
+    size_t n = MIN(req->req_n, sizeof(req->req_buf));
+    if ((count = file_write(o->o_file, req->req_buf, n, o->o_fd->fd_offset)) < 0) {
         return count;
     }
     o->o_fd->fd_offset += count;
@@ -311,6 +397,96 @@ fshandler handlers[] = {
 	[FSREQ_SYNC] =		serve_sync
 };
 
+// Serve the requests posted on cr since last time.  Returns how many.
+static int
+ring_serve(struct ClientRing *cr)
+{
+	struct Fsring *ring = ring_va(cr);
+	union Fsipc *slot;
+	uint32_t tail = ring->r_sq_tail, req;
+	int n = 0, r, err = 0;
+
+	if (tail - cr->cr_sq_head > FSRING_NENT) {
+		cprintf("Bad request ring from %08x\n", cr->cr_envid);
+		ring_release(cr);
+		return 0;
+	}
+	// Read the requests only after the tail that covers them
+	asm volatile("" ::: "memory");
+	for (; cr->cr_sq_head != tail; cr->cr_sq_head++, n++) {
+		req = ring->r_sq[cr->cr_sq_head % FSRING_NENT];
+		slot = (union Fsipc *) ((char *) ring + PGSIZE) + cr->cr_sq_head % FSRING_NENT;
+		if (debug)
+			cprintf("fs ring req %d from %08x\n", req, cr->cr_envid);
+		// Requests that pass pages only work over IPC.  The ones
+		// published with a failed one fail with it (see struct Fsring).
+		if (err < 0)
+			r = err;
+		else if (req != FSREQ_OPEN && req < ARRAY_SIZE(handlers) && handlers[req])
+			r = err = handlers[req](cr->cr_envid, slot);
+		else
+			r = err = -E_INVAL;
+		ring->r_cq[cr->cr_sq_head % FSRING_NENT] = r;
+		// Complete the request only once its result is in place
+		asm volatile("" ::: "memory");
+		ring->r_cq_tail = cr->cr_sq_head + 1;
+	}
+	// Publish r_cq_tail before looking at r_waiting
+	__sync_synchronize();
+	if (n > 0 && ring->r_waiting) {
+		ring->r_waiting = 0;
+		sys_wake((void *) &ring->r_cq_tail, 1);
+	}
+	return n;
+}
+
+// Serve each live ring once, releasing those whose client is gone.
+// Returns the number of requests served.
+static int
+ring_serve_pass(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < MAXRINGS; i++) {
+		if (ringtab[i].cr_envid == 0)
+			continue;
+		if (ring_live(&ringtab[i]))
+			n += ring_serve(&ringtab[i]);
+		else
+			ring_release(&ringtab[i]);
+	}
+	return n;
+}
+
+static void
+ring_set_idle(uint32_t idle)
+{
+	int i;
+
+	for (i = 0; i < MAXRINGS; i++)
+		if (ringtab[i].cr_envid != 0)
+			ring_va(&ringtab[i])->r_idle = idle;
+}
+
+// Serve the request rings until they run dry.  Before the server goes
+// to sleep in IPC, mark the rings idle so that clients ring the
+// doorbell, and look once more for requests posted meanwhile.
+static void
+ring_serve_all(void)
+{
+	ring_set_idle(0);
+	for (;;) {
+		while (ring_serve_pass() > 0)
+			;
+		ring_set_idle(1);
+		// Publish r_idle before the last look at r_sq_tail
+		__sync_synchronize();
+		if (ring_serve_pass() == 0)
+			return;
+		ring_set_idle(0);
+	}
+}
+
 void
 serve(void)
 {
@@ -318,31 +494,47 @@ serve(void)
 	int perm, r;
 	void *pg;
 
+	whom = 0;
+	r = 0;
+	pg = NULL;
+	perm = 0;
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		ring_serve_all();
+
+		// Reply to the last request, if any, and wait for the next.
+		// The next argument page replaces the last one at fsreq.
+		req = ipc_reply_wait(whom, r, pg, perm,
+				     (envid_t *) &whom,
+				     IPC_RANGE(fsreq, FSRING_NPAGES), &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
+		// Nothing to do but look at the rings
+		if (req == FSREQ_RING_DOORBELL) {
+			whom = 0;
+			continue;
+		}
+
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
+			whom = 0;
 			continue; // just leave it hanging...
 		}
 
 		pg = NULL;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_RING_SETUP) {
+			r = serve_ring_setup(whom, thisenv->env_ipc_npages);
 		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
 	}
 }
 
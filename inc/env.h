@@ -30,7 +30,8 @@ typedef int32_t envid_t;
 #define ENVX(envid)		((envid) & (NENV - 1))
 
 
-#define MAX_BREAKPOINTS ((PGSIZE) / (sizeof(struct BreakPoint)))
+// Breakpoints set from the monitor, one per debug register DR0-DR3.
+#define MAX_BREAKPOINTS NDEBUGREG
 
 // Values of env_status in struct Env
 enum {
@@ -48,6 +49,18 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+// Scheduling classes, in env_sched_class (see kern/sched.c)
+enum {
+	SCHED_FAIR = 0,		// Share the CPU in proportion to weight
+	SCHED_RT,		// Run ahead of every SCHED_FAIR environment
+};
+
+#define SCHED_WEIGHT_DEFAULT	1024
+#define SCHED_WEIGHT_MAX	(64 * 1024)
+
+// env_cpumask of an environment that may run on any CPU
+#define CPUMASK_ALL		(~(uint32_t) 0)
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -57,6 +70,27 @@ struct Env {
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
+	bool env_sysexit;		// env_tf is from sysenter (see env_pop_tf)
+
+	// FPU and SSE state (see kern/fpu.c)
+	struct FpuState *env_fpu;	// Saved registers, or NULL if unused
+	int env_fpu_cpu;		// CPU whose registers last held them
+
+	// Scheduling
+	struct Env *env_rq_next;	// Next env on the run queue
+	struct Env *env_rq_prev;	// Previous env on the run queue
+	int env_rq_cpu;			// CPU whose run queue holds us, or -1
+	int env_sched_class;		// SCHED_FAIR or SCHED_RT
+	uint32_t env_sched_weight;	// Share of the CPU under SCHED_FAIR
+	uint64_t env_vruntime;		// Runtime scaled by the weight
+	uint64_t env_runtime;		// TSC cycles spent running in total
+	uint64_t env_run_start;		// TSC when last charged for running
+	uint32_t env_cpumask;		// CPUs we may run on, bit n for CPU n
+
+	// Wait channels
+	physaddr_t env_wait_key;	// Physical address we sleep on, or 0
+	uint32_t env_wait_deadline;	// time_msec() to time out at, or 0
+	struct Env *env_wait_link;	// Next env sleeping in the same bucket
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
@@ -65,25 +99,40 @@ struct Env {
 	void *env_pgfault_upcall;	// Page fault upcall entry point
 
 	// Lab 4 IPC
-	bool env_ipc_recving;		// Env is blocked receiving
-	void *env_ipc_dstva;		// VA at which to map received page
+	uint32_t env_ipc_recving;	// Env is blocked receiving
+	void *env_ipc_dstva;		// Range at which to map received pages
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	int env_ipc_npages;		// Number of pages received
+	struct IpcQueue *env_ipc_queue;	// Messages sent while not receiving
+	uint32_t env_ipc_seq;		// Bumped when a send may now succeed
+					// (a wait word, see sys_wait_on)
                               
                               
-    struct BreakPoint *bp;
+    uintptr_t bp[MAX_BREAKPOINTS];	// Breakpoint addresses, in DR0-DR3
     size_t bpnum;
+    uint32_t env_dr7;			// DR7 enabling them, 0 if none
 
     // used for exec
     pde_t *exec_pgdir;
 };
 
 
-struct BreakPoint {
-    uintptr_t va;
-    unsigned char victim;
-    char padding[3];
-};
+// IPC sends and receives name their pages by a range: a page-aligned
+// va with the number of pages, less one, in its low bits.  A plain
+// page-aligned va is a range of one page.
+#define IPC_MAXPAGES		PGSIZE
+#define IPC_RANGE(va, n)	((void *) ((uintptr_t) (va) | ((n) - 1)))
+#define IPC_RANGE_VA(r)		((void *) ROUNDDOWN((uintptr_t) (r), PGSIZE))
+#define IPC_RANGE_NPAGES(r)	(PGOFF(r) + 1)
+
+// The send system calls take a page-aligned srcva and the number of
+// pages in the bits of perm above PTE_SYSCALL.  lib/ipc.c converts an
+// IPC page range into this form.
+#define IPC_PERM_NPAGES(n)	((uint32_t) ((n) - 1) << PGSHIFT)
+#define IPC_PERM_NPAGES_MASK	IPC_PERM_NPAGES(IPC_MAXPAGES)
+#define IPC_PERM_GET_NPAGES(perm) \
+	((((perm) & IPC_PERM_NPAGES_MASK) >> PGSHIFT) + 1)
 
 #endif // !JOS_INC_ENV_H
@@ -70,7 +70,13 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Ring setup: grants the FSRING_NPAGES pages of the client's
+	// request ring, the struct Fsring page first, in one message
+	FSREQ_RING_SETUP,
+	// Sent without a page and not answered: the server has gone idle
+	// and requests are waiting on the sender's ring
+	FSREQ_RING_DOORBELL
 };
 
 union Fsipc {
@@ -113,4 +119,28 @@ union Fsipc {
 	char _pad[PGSIZE];
 };
 
+// A request ring lets a client post read, write, stat and similar
+// requests without an IPC per request.  It is a struct Fsring page
+// followed by FSRING_NENT pages of request slots, shared with the file
+// server.  Request i uses slot i % FSRING_NENT, which holds its union
+// Fsipc arguments and results as for fsipc.  The server completes
+// requests in order, so the completion ring needs only a tail.
+//
+// The client publishes a batch of requests with a single r_sq_tail
+// store.  Once a request fails, the server fails the rest of the batch
+// with the same error without running them, so that, say, the writes
+// after a failed write do not land where it should have.
+#define FSRING_NENT	16
+#define FSRING_NPAGES	(1 + FSRING_NENT)
+
+struct Fsring {
+	int32_t r_owner;		// envid of the client
+	volatile uint32_t r_sq_tail;	// Requests posted (client)
+	volatile uint32_t r_cq_tail;	// Requests completed (server)
+	volatile uint32_t r_idle;	// Server is asleep: ring the doorbell
+	volatile uint32_t r_waiting;	// Client sleeps on r_cq_tail
+	uint32_t r_sq[FSRING_NENT];	// Request codes (FSREQ_*)
+	int32_t r_cq[FSRING_NENT];	// Results
+};
+
 #endif /* !JOS_INC_FS_H */
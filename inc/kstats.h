@@ -0,0 +1,42 @@
+#ifndef JOS_INC_KSTATS_H
+#define JOS_INC_KSTATS_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+
+// Kernel latency statistics.  Each CPU counts the traps it handles and
+// the system calls it runs, with a log2 histogram of how many TSC
+// cycles each took from trap_dispatch to the return to user mode (see
+// kern/kstats.c).  The per-CPU tables are mapped read-only at UKSTATS,
+// so user programs can sample them without a system call.
+
+// Number of tables, one per CPU; must equal NCPU in kern/cpu.h.
+#define KSTAT_NCPU	8
+
+// The tables share the read-only UENVS slot with the envs array, on
+// the pages right after it.
+#define UKSTATS		(UENVS + (NENV * sizeof(struct Env) + PGSIZE - 1) / PGSIZE * PGSIZE)
+
+#define KSTAT_NBUCKET	32	// Histogram buckets
+#define KSTAT_NTRAP	64	// Trap numbers counted, IRQs included
+#define KSTAT_NSYSCALL	64	// System call numbers counted
+
+struct KstatHist {
+	uint64_t kh_cycles;		// Total cycles
+	uint64_t kh_max;		// Longest, in cycles
+	uint32_t kh_count;		// Number of events
+	uint32_t kh_padding;
+	// kh_bucket[i] counts events of 2^i to 2^(i+1) - 1 cycles; the
+	// last bucket also takes anything longer.
+	uint32_t kh_bucket[KSTAT_NBUCKET];
+};
+
+struct Kstats {
+	struct KstatHist ks_trap[KSTAT_NTRAP];
+	struct KstatHist ks_syscall[KSTAT_NSYSCALL];
+} __attribute__((aligned(PGSIZE)));
+
+void	kstats_print(const volatile struct Kstats *ks, int ncpu);
+
+#endif	// !JOS_INC_KSTATS_H
@@ -22,6 +22,7 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/kstats.h>
 
 #define USED(x)		(void)(x)
 
@@ -33,6 +34,7 @@ extern const char *binaryname;
 extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
+extern const volatile struct Kstats *kstats;
 
 // exit.c
 void	exit(void);
@@ -43,6 +45,10 @@ void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
 // readline.c
 char*	readline(const char *buf);
 
+// string.c
+extern int string_sse2;
+void	string_init(void);
+
 // syscall.c
 void	sys_cputs(const char *string, size_t len);
 int	sys_cgetc(void);
@@ -50,7 +56,10 @@ envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
 int	sys_env_set_status(envid_t env, int status);
+int	sys_env_set_sched(envid_t env, int class, uint32_t weight);
+int	sys_env_set_affinity(envid_t env, uint32_t cpumask);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
@@ -60,8 +69,14 @@ int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
 unsigned int sys_time_msec(void);
+int	sys_wait_on(void *va, uint32_t expected, unsigned int timeout);
+int	sys_wake(void *va, int n);
+int	sys_sleep(unsigned int msec);
 int sys_transmit_packet(void *va, size_t n);
 ssize_t sys_recv_packet(void *va, size_t max_n);
+int	sys_page_batch(const struct PageOp *ops, int n);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
 
 int sys_exec_config_pgdir_alloc(envid_t envid);
 int sys_exec_config_page_alloc(envid_t envid, void *va, int perm);
@@ -81,13 +96,41 @@ sys_exofork(void)
 	return ret;
 }
 
+// pagebatch.c
+#define PAGEBATCH_MAX	16	// Operations queued per sys_page_batch
+
+struct PageBatch {
+	int pb_n;
+	struct PageOp pb_ops[PAGEBATCH_MAX];
+};
+
+void	pagebatch_init(struct PageBatch *pb);
+int	pagebatch_flush(struct PageBatch *pb);
+int	pagebatch_alloc(struct PageBatch *pb, envid_t envid, void *va, int perm);
+int	pagebatch_map(struct PageBatch *pb, envid_t srcenv, void *srcva,
+		      envid_t dstenv, void *dstva, int perm);
+int	pagebatch_unmap(struct PageBatch *pb, envid_t envid, void *va);
+int	pagebatch_exec_alloc(struct PageBatch *pb, envid_t envid, void *va,
+			     int perm);
+int	pagebatch_exec_map(struct PageBatch *pb, envid_t srcenv, void *srcva,
+			   envid_t dstenv, void *dstva, int perm);
+
+// bench.c
+#define BENCH_MAXITERS	4096	// Samples kept per benchmark
+
+int	bench_iters(int argc, char **argv, int dflt);
+void	bench_report(const char *name, uint64_t *cycles, int n);
+
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -178,6 +178,8 @@ extern volatile pde_t uvpd[];     // VA of current page directory
 struct PageInfo {
 	// Next page on the free list.
 	struct PageInfo *pp_link;
+	// Previous block on a buddy allocator free list.
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -185,7 +187,21 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// PP_* flags below.
+	uint8_t pp_flags;
+	// For a PP_FREE block, log2 of its size in pages.
+	uint8_t pp_order;
 };
 
+// pp_flags: the page heads a PTSIZE-aligned block of NPTENTRIES pages
+// mapped as one 4MB page.  Its pp_ref counts the references to any
+// page in the block.
+#define PP_LARGE	0x1
+// pp_flags: the page heads a free block in the buddy allocator.
+#define PP_FREE		0x2
+// pp_flags: the page belongs to a kmalloc slab of order pp_order.
+#define PP_SLAB		0x4
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
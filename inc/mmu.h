@@ -69,6 +69,11 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// The user library's use of the PTE_AVAIL bits, which sys_fork also
+// follows.
+#define PTE_SHARE	0x400	// Shared between parent and child on fork
+#define PTE_COW		0x800	// Copy-on-write
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -88,6 +93,8 @@
 #define CR0_CD		0x40000000	// Cache Disable
 #define CR0_PG		0x80000000	// Paging
 
+#define CR4_OSXMMEXCPT	0x00000400	// Unmasked SSE exceptions raise #XM
+#define CR4_OSFXSR	0x00000200	// fxsave/fxrstor and SSE enabled
 #define CR4_PCE		0x00000100	// Performance counter enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
@@ -96,6 +103,15 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 
+// Debug registers: DR0-DR3 hold breakpoint addresses, DR6 reports
+// which one fired, DR7 enables them.  An enabled DR7 entry with zero
+// R/W and LEN bits is an instruction breakpoint.
+#define NDEBUGREG	4
+#define DR6_B(n)	(1 << (n))	// Breakpoint n was hit
+#define DR6_BMASK	0x0000000f	//   any of DR0-DR3
+#define DR6_BS		0x00004000	// Single step
+#define DR7_L(n)	(1 << ((n) * 2))	// Local enable for breakpoint n
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
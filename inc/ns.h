@@ -103,4 +103,10 @@ union Nsipc {
 	char _pad[PGSIZE];
 };
 
+// A request may be granted as an IPC page range of up to NSIPC_NPAGES
+// pages (see IPC_RANGE).  Only NSREQ_SEND uses more than one, to pass
+// up to NSIPC_MAXSEND bytes in a single request.
+#define NSIPC_NPAGES	17
+#define NSIPC_MAXSEND	(NSIPC_NPAGES * PGSIZE - sizeof(struct Nsreq_send))
+
 #endif // !JOS_INC_NS_H
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -11,7 +13,10 @@ enum {
 	SYS_page_map,
 	SYS_page_unmap,
 	SYS_exofork,
+	SYS_fork,
 	SYS_env_set_status,
+	SYS_env_set_sched,
+	SYS_env_set_affinity,
 	SYS_env_set_trapframe,
 	SYS_env_set_pgfault_upcall,
 	SYS_yield,
@@ -25,11 +30,39 @@ enum {
     SYS_exec,
 
 	SYS_time_msec,
+	SYS_wait_on,
+	SYS_wake,
+	SYS_sleep,
 
     SYS_transmit_packet,
     SYS_recv_packet,
 
+	SYS_page_batch,
+
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+
 	NSYSCALLS
 };
 
+// Operations for SYS_page_batch.  Each one behaves exactly like the
+// single-page system call it names.
+enum {
+	PAGEOP_ALLOC = 0,	// sys_page_alloc(dstenv, dstva, perm)
+	PAGEOP_MAP,		// sys_page_map(srcenv, srcva, dstenv, dstva, perm)
+	PAGEOP_UNMAP,		// sys_page_unmap(dstenv, dstva)
+	PAGEOP_EXEC_ALLOC,	// sys_exec_config_page_alloc(dstenv, dstva, perm)
+	PAGEOP_EXEC_MAP,	// sys_exec_config_page_map(srcenv, srcva,
+				//			    dstenv, dstva, perm)
+};
+
+struct PageOp {
+	int op;			// PAGEOP_*
+	int32_t srcenv;		// envid_t
+	void *srcva;
+	int32_t dstenv;		// envid_t
+	void *dstva;
+	int perm;
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -37,7 +37,9 @@
 #define IRQ_SERIAL       4
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
+#define IRQ_TLB         18	// TLB shootdown IPI (see tlb_shootdown)
 #define IRQ_ERROR       19
+#define IRQ_RESCHED     20	// Reschedule IPI (see sched_enqueue)
 
 #ifndef __ASSEMBLER__
 
@@ -74,6 +76,26 @@ struct Trapframe {
 	uint16_t tf_padding4;
 } __attribute__((packed));
 
+// FPU, MMX and SSE registers, in the layout of fxsave and fxrstor.
+struct FpuState {
+	uint16_t fs_fcw;		/* x87 control word */
+	uint16_t fs_fsw;		/* x87 status word */
+	uint8_t fs_ftw;			/* abridged tag word, 0 = all empty */
+	uint8_t fs_padding1;
+	uint16_t fs_fop;
+	uint32_t fs_fip;
+	uint16_t fs_fcs;
+	uint16_t fs_padding2;
+	uint32_t fs_fdp;
+	uint16_t fs_fds;
+	uint16_t fs_padding3;
+	uint32_t fs_mxcsr;		/* SSE control and status */
+	uint32_t fs_mxcsr_mask;
+	uint8_t fs_st[8][16];		/* st0-st7 (mm0-mm7) */
+	uint8_t fs_xmm[8][16];		/* xmm0-xmm7 */
+	uint8_t fs_padding4[224];
+} __attribute__((packed, aligned(16)));
+
 struct UTrapframe {
 	/* information about the fault */
 	uint32_t utf_fault_va;	/* va for T_PGFLT, 0 otherwise */
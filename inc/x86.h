@@ -149,6 +149,13 @@ rcr0(void)
 	return val;
 }
 
+// Clear CR0.TS, letting FPU and SSE instructions run.
+static inline void
+clts(void)
+{
+	asm volatile("clts");
+}
+
 static inline uint32_t
 rcr2(void)
 {
@@ -185,6 +192,52 @@ rcr4(void)
 	return cr4;
 }
 
+// Load breakpoint address va into debug register DRn, n < NDEBUGREG.
+static inline void
+ldr(int n, uint32_t va)
+{
+	switch (n) {
+	case 0: asm volatile("movl %0,%%db0" : : "r" (va)); break;
+	case 1: asm volatile("movl %0,%%db1" : : "r" (va)); break;
+	case 2: asm volatile("movl %0,%%db2" : : "r" (va)); break;
+	case 3: asm volatile("movl %0,%%db3" : : "r" (va)); break;
+	}
+}
+
+static inline void
+ldr6(uint32_t val)
+{
+	asm volatile("movl %0,%%db6" : : "r" (val));
+}
+
+static inline uint32_t
+rdr6(void)
+{
+	uint32_t dr6;
+	asm volatile("movl %%db6,%0" : "=r" (dr6));
+	return dr6;
+}
+
+static inline void
+ldr7(uint32_t val)
+{
+	asm volatile("movl %0,%%db7" : : "r" (val));
+}
+
+// Save and restore the FPU and SSE registers in a 16-byte aligned,
+// 512-byte area (struct FpuState).
+static inline void
+fxsave(void *area)
+{
+	asm volatile("fxsave (%0)" : : "r" (area) : "memory");
+}
+
+static inline void
+fxrstor(const void *area)
+{
+	asm volatile("fxrstor (%0)" : : "r" (area) : "memory");
+}
+
 static inline void
 tlbflush(void)
 {
@@ -223,6 +276,13 @@ read_esp(void)
 	return esp;
 }
 
+// Feature flags returned by cpuid(1) in edx
+#define CPUID_EDX_PSE	0x00000008	// 4MB pages (CR4_PSE)
+#define CPUID_EDX_SEP	0x00000800	// sysenter and sysexit
+#define CPUID_EDX_FXSR	0x01000000	// fxsave and fxrstor
+#define CPUID_EDX_SSE	0x02000000
+#define CPUID_EDX_SSE2	0x04000000
+
 static inline void
 cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
 {
@@ -240,6 +300,17 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
 		*edxp = edx;
 }
 
+// Model-specific registers for sysenter (see trap_init_percpu)
+#define MSR_SYSENTER_CS		0x174
+#define MSR_SYSENTER_ESP	0x175
+#define MSR_SYSENTER_EIP	0x176
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 static inline uint64_t
 read_tsc(void)
 {
@@ -23,6 +23,12 @@ struct CpuInfo {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	pde_t *volatile cpu_pgdir;      // User page directory in CR3, or NULL
+	volatile uint32_t cpu_cr3_loads; // Number of CR3 loads (see pgdir_load)
+	bool cpu_sysenter_step;         // Single-stepped into sysenter (see trap)
+	uint32_t cpu_dr7;               // Breakpoints enabled in DR7, if any
+	envid_t cpu_fpu_envid;          // Env whose FPU registers were loaded last
+	bool cpu_fpu_loaded;            // They are curenv's and CR0.TS is clear
 };
 
 // Initialized in mpconfig.c
@@ -42,5 +48,17 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+void lapic_timer_periodic(void);
+void lapic_timer_oneshot(unsigned int msec);
+void lapic_timer_stop(void);
+
+// Invalidations one TLB shootdown IPI can carry before it falls back
+// to flushing the whole TLB.
+#define TLB_SHOOTDOWN_MAX	32
+
+uint32_t tlb_shootdown_cpus(pde_t *pgdir);
+void tlb_shootdown(uint32_t cpumask, const uintptr_t *va, int nva);
+void tlb_shootdown_intr(void);
 
 #endif
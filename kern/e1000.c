@@ -31,6 +31,7 @@ struct rx_desc {
 #define MAX_TX_DESC_NUM 64
 #define MAX_RX_DESC_NUM 128
 #define MAX_PACKET_LEN 1518
+#define BUFFER_SIZE 2048 /* Per-descriptor buffer, matches E1000_RCTL_SZ_2048 */
 
 struct tx_desc *tx_desc_array;
 void *tx_buffers[MAX_TX_DESC_NUM];
@@ -38,6 +39,22 @@ void *tx_buffers[MAX_TX_DESC_NUM];
 struct rx_desc *rx_desc_array;
 void *rx_buffers[MAX_RX_DESC_NUM];
 
+// Allocate n bytes of zeroed, physically contiguous memory for DMA and
+// return its kernel virtual address, or NULL if out of memory.
+static void *
+e1000_dma_alloc(size_t n)
+{
+    int order = 0;
+    while ((PGSIZE << order) < n) {
+        order++;
+    }
+    struct PageInfo *pp = page_alloc_npages(order, ALLOC_ZERO);
+    if (pp == NULL) {
+        return NULL;
+    }
+    return page2kva(pp);
+}
+
 // LAB 6: Your driver code here
 int e1000_attach(struct pci_func *pcif) {
     // alloc physical memory for the device
@@ -51,23 +68,18 @@ int e1000_attach(struct pci_func *pcif) {
     /* setup transmit queue ring (section 3.4 && 14.5) */
 
     // alloc memory tx desc array
-    struct PageInfo *pp = page_alloc(ALLOC_ZERO);
-    if (pp == NULL) {
+    tx_desc_array = e1000_dma_alloc(MAX_TX_DESC_NUM * sizeof(struct tx_desc));
+    if (tx_desc_array == NULL) {
         return -E_NO_MEM;
     }
-    tx_desc_array = page2kva(pp);
 
-    // alloc memory pointed to by each tx desc
+    // alloc memory pointed to by each tx desc, in one contiguous block
+    void *tx_area = e1000_dma_alloc(MAX_TX_DESC_NUM * BUFFER_SIZE);
+    if (tx_area == NULL) {
+        return -E_NO_MEM;
+    }
     for (size_t tx = 0; tx < MAX_TX_DESC_NUM; tx++) {
-        if (tx % 2 == 0) {
-            struct PageInfo *pp = page_alloc(ALLOC_ZERO);
-            if (pp == NULL) {
-                return -E_NO_MEM;
-            }
-            tx_buffers[tx] = page2kva(pp);
-        } else {
-            tx_buffers[tx] = tx_buffers[tx - 1] + MAX_PACKET_LEN;
-        }
+        tx_buffers[tx] = tx_area + tx * BUFFER_SIZE;
         tx_desc_array[tx].addr = PADDR(tx_buffers[tx]); // the driver access physical address!
         // Report Status (RS): set Descriptor done bit (DD) of status field 
         // if the descriptor is ready to be recyle
@@ -95,24 +107,19 @@ int e1000_attach(struct pci_func *pcif) {
     /* setup receive queue ring (section 3.2.6 && 14.4) */
 
     // alloc memory rx desc array
-    pp = page_alloc(ALLOC_ZERO);
-    if (pp == NULL) {
+    rx_desc_array = e1000_dma_alloc(MAX_RX_DESC_NUM * sizeof(struct rx_desc));
+    if (rx_desc_array == NULL) {
         return -E_NO_MEM;
     }
-    rx_desc_array = page2kva(pp);
 
-
-    // alloc memory (2048 in bytes) pointed to by each rx desc
+    // alloc memory (2048 in bytes) pointed to by each rx desc, in one
+    // contiguous block
+    void *rx_area = e1000_dma_alloc(MAX_RX_DESC_NUM * BUFFER_SIZE);
+    if (rx_area == NULL) {
+        return -E_NO_MEM;
+    }
     for (size_t rx = 0; rx < MAX_RX_DESC_NUM; rx++) {
-        if (rx % 2 == 0) {
-            struct PageInfo *pp = page_alloc(ALLOC_ZERO);
-            if (pp == NULL) {
-                return -E_NO_MEM;
-            }
-            rx_buffers[rx] = page2kva(pp);
-        } else {
-            rx_buffers[rx] = rx_buffers[rx - 1] + 2048;
-        }
+        rx_buffers[rx] = rx_area + rx * BUFFER_SIZE;
         rx_desc_array[rx].addr = PADDR(rx_buffers[rx]); // the driver access physical address!
     }
 
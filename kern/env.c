@@ -10,16 +10,29 @@
 #include <inc/elf.h>
 
 #include <kern/env.h>
+#include <kern/fpu.h>
+#include <kern/kstats.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/wait.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+static struct spinlock env_table_lock =	// Protects env_free_list
+	SPINLOCK_INIT(env_table_lock, LOCK_RANK_ENVTABLE);
+
+// Per-environment locks.  They live beside envs[] rather than in
+// struct Env, which is also mapped read-only into user space.
+static struct EnvLocks {
+	struct spinlock el_vm;		// Address space
+	struct spinlock el_ipc;		// IPC state
+} env_locks[NENV];
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -110,6 +123,71 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+// Is e still the environment 'envid' referred to when the caller looked
+// it up?  envid 0 means curenv, which can only be freed on its own CPU.
+static bool
+env_still_valid(struct Env *e, envid_t envid)
+{
+	return envid == 0 || (e->env_id == envid && e->env_status != ENV_FREE);
+}
+
+int
+env_lock_vm(struct Env *e, envid_t envid)
+{
+    spin_lock(&env_locks[e - envs].el_vm);
+    if (!env_still_valid(e, envid)) {
+        spin_unlock(&env_locks[e - envs].el_vm);
+        return -E_BAD_ENV;
+    }
+    return 0;
+}
+
+// Lock two address spaces, which may be the same one.  Locks of the same
+// rank are taken in address order, i.e. by envs[] index.
+int
+env_lock_vm2(struct Env *a, envid_t aid, struct Env *b, envid_t bid)
+{
+    struct Env *lo = a < b ? a : b;
+    struct Env *hi = a < b ? b : a;
+
+    spin_lock(&env_locks[lo - envs].el_vm);
+    if (hi != lo) {
+        spin_lock(&env_locks[hi - envs].el_vm);
+    }
+    if (!env_still_valid(a, aid) || !env_still_valid(b, bid)) {
+        env_unlock_vm2(a, b);
+        return -E_BAD_ENV;
+    }
+    return 0;
+}
+
+void
+env_unlock_vm(struct Env *e)
+{
+    spin_unlock(&env_locks[e - envs].el_vm);
+}
+
+void
+env_unlock_vm2(struct Env *a, struct Env *b)
+{
+    spin_unlock(&env_locks[a - envs].el_vm);
+    if (b != a) {
+        spin_unlock(&env_locks[b - envs].el_vm);
+    }
+}
+
+void
+env_lock_ipc(struct Env *e)
+{
+    spin_lock(&env_locks[e - envs].el_ipc);
+}
+
+void
+env_unlock_ipc(struct Env *e)
+{
+    spin_unlock(&env_locks[e - envs].el_ipc);
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -124,6 +202,9 @@ env_init(void)
     size_t n = NENV;
     while (n-- > 0) {
         envs[n].env_id = 0;
+        envs[n].env_rq_cpu = -1;
+        __spin_initlock(&env_locks[n].el_vm, "env_vm_lock", LOCK_RANK_VM);
+        __spin_initlock(&env_locks[n].el_ipc, "env_ipc_lock", LOCK_RANK_IPC);
         envs[n].env_link = env_free_list;
         env_free_list = &envs[n];
     }
@@ -221,12 +302,22 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_table_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_table_lock);
 		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_table_lock);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_table_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_table_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -245,6 +336,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// of a prior environment inhabiting this Env structure
 	// from "leaking" into our new environment.
 	memset(&e->env_tf, 0, sizeof(e->env_tf));
+	e->env_sysexit = false;
+	e->env_fpu = NULL;
+	e->env_fpu_cpu = -1;
+	e->env_sched_class = SCHED_FAIR;
+	e->env_sched_weight = SCHED_WEIGHT_DEFAULT;
+	e->env_vruntime = 0;
+	e->env_runtime = 0;
+	e->env_cpumask = CPUMASK_ALL;
 
 	// Set up appropriate initial values for the segment registers.
 	// GD_UD is the user data segment selector in the GDT, and
@@ -270,14 +369,13 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_ipc_queue = NULL;
 
 
-    e->bp = 0;
     e->bpnum = 0;
+    e->env_dr7 = 0;
     e->exec_pgdir = 0;
 
-	// commit the allocation
-	env_free_list = e->env_link;
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -382,7 +480,7 @@ load_icode(struct Env *e, uint8_t *binary)
     // Since above UTOP, e->env_pgdir has identical mappings as kern_pgdir,
     // we can copy bytes at (void *)binary to (void *)ph->p_va then,
     // the paging of which is only installed at e->env_pgdir.
-    lcr3(PADDR(e->env_pgdir));
+    pgdir_load(e->env_pgdir);
 
 	for (; ph < eph; ph++) {
         if (ph->p_type == ELF_PROG_LOAD) {
@@ -409,7 +507,7 @@ load_icode(struct Env *e, uint8_t *binary)
     page_insert(e->env_pgdir, pp, (void *)USTACKTOP - PGSIZE, PTE_P | PTE_U | PTE_W);
 
     // Switch back to the kernel address space
-    lcr3(PADDR(kern_pgdir));
+    pgdir_load(kern_pgdir);
 }
 
 //
@@ -440,27 +538,51 @@ env_create(uint8_t *binary, enum EnvType type)
         e->env_tf.tf_eflags &= ~FL_IOPL_MASK;
         e->env_tf.tf_eflags |= FL_IOPL_3;
     }
+    // The servers are what everybody else waits on: never let a busy
+    // user environment make them wait for the CPU.
+    if (type == ENV_TYPE_FS || type == ENV_TYPE_NS) {
+        e->env_sched_class = SCHED_RT;
+    }
+    sched_enqueue(e);
 }
 
-int
-env_breakpoints_alloc(struct Env *e) {
-    struct PageInfo *pp;
-    if ((pp = page_alloc(0)) == NULL) {
-        return -E_NO_MEM;
+// Load e's breakpoints into this CPU's debug registers, or disable the
+// ones the last environment debugged here left behind.  Environments
+// without breakpoints, on a CPU that has none enabled, skip it all.
+void
+env_load_debugregs(struct Env *e)
+{
+    if (e->env_dr7 == 0 && thiscpu->cpu_dr7 == 0) {
+        return;
     }
-    e->bp = page2kva(pp);
-    e->bpnum = 0;
-    pp->pp_ref += 1;
-    return 0;
+    for (size_t i = 0; i < e->bpnum; i++) {
+        ldr(i, e->bp[i]);
+    }
+    ldr7(e->env_dr7);
+    thiscpu->cpu_dr7 = e->env_dr7;
 }
 
+// Drop the messages queued for e, releasing the pages they carry.
 void
-env_breakpoints_remove(struct Env *e) {
-    if (e->bp) {
-    	page_decref(pa2page(PADDR(e->bp)));
-        e->bp = NULL;
-        e->bpnum = 0;
+env_ipc_queue_free(struct Env *e)
+{
+    struct IpcQueue *q;
+    env_lock_ipc(e);
+    if ((q = e->env_ipc_queue) != NULL) {
+        for (; q->iq_count > 0; q->iq_count--) {
+            struct IpcMsg *m = &q->iq_msgs[q->iq_head];
+            for (int i = 0; i < m->im_npages; i++) {
+                page_decref(m->im_pages[i]);
+            }
+            if (m->im_pages != &m->im_page) {
+                kfree(m->im_pages);
+            }
+            q->iq_head = (q->iq_head + 1) % IPC_QUEUE_LEN;
+        }
+        kfree(q);
+        e->env_ipc_queue = NULL;
     }
+    env_unlock_ipc(e);
 }
 
 int 
@@ -487,19 +609,7 @@ env_alloc_pgdir(pde_t **pgdir_store) {
 void
 env_free_pgdir(pde_t *pgdir) {
 	for (size_t pdx = 0; pdx < PDX(UTOP); pdx++) {
-		if (!(pgdir[pdx] & PTE_P)) {
-			continue;
-        }
-
-		physaddr_t pa = PTE_ADDR(pgdir[pdx]);
-		pte_t *pt = (pte_t*)KADDR(pa);
-		for (size_t ptx = 0; ptx < NPTENTRIES; ptx++) {
-			if (pt[ptx] & PTE_P) {
-		        page_remove(pgdir, PGADDR(pdx, ptx, 0));
-            }
-		}
-		pgdir[pdx] = 0;
-		page_decref(pa2page(pa));
+		page_remove_pt(pgdir, PGADDR(pdx, 0, 0));
 	}
 
     // free the page directory itself
@@ -516,25 +626,42 @@ env_free(struct Env *e)
 	// before freeing the page directory, just in case the page
 	// gets reused.
 	if (e == curenv) {
-		lcr3(PADDR(kern_pgdir));
-    }
-
-    if (e->bp) {
-        env_breakpoints_remove(e);
+		pgdir_load(kern_pgdir);
     }
 
+    // Other CPUs may be mapping pages into e without the kernel lock;
+    // they recheck env_status once they get e's address-space lock.
+    spin_lock(&env_locks[e - envs].el_vm);
     env_free_pgdir(e->env_pgdir);
     e->env_pgdir = 0;
 
+    fpu_free(e);
+
     if (e->exec_pgdir) {
         env_free_pgdir(e->exec_pgdir);
         e->exec_pgdir = 0;
     }
 
-	// return the environment to the free list
+	sched_remove(e);
+	wait_remove(e);
 	e->env_status = ENV_FREE;
+	spin_unlock(&env_locks[e - envs].el_vm);
+
+	// Senders recheck env_status under e's IPC lock, so nothing is
+	// queued after this.
+	env_ipc_queue_free(e);
+
+	// wake anybody in wait() for us, and senders in ipc_send()
+	// so that they notice we are gone
+	wait_wake(PADDR(&e->env_status), NENV);
+	e->env_ipc_seq++;
+	wait_wake(PADDR(&e->env_ipc_seq), NENV);
+
+	// return the environment to the free list
+	spin_lock(&env_table_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_table_lock);
 }
 
 //
@@ -574,6 +701,28 @@ env_pop_tf(struct Trapframe *tf)
 	// Record the CPU we are running on for user-space debugging
 	curenv->env_cpunum = cpunum();
 
+	// Back from a system call made with sysenter, sysexit can return
+	// instead of iret: it takes %eip and %esp from %edx and %ecx, which
+	// the library's stub gives up, and loads the flat user segments.
+	// tf_err means nothing for a system call; it carries the flags to
+	// load, with interrupts kept off until sti's one-instruction delay
+	// covers sysexit.  Single-stepping needs iret to set TF.
+	if (curenv->env_sysexit && !(tf->tf_eflags & FL_TF)) {
+		tf->tf_err = tf->tf_eflags & ~FL_IF;
+		asm volatile(
+			"\tmovl %0,%%esp\n"
+			"\tpopal\n"
+			"\tpopl %%es\n"
+			"\tpopl %%ds\n"
+			"\tmovl 8(%%esp),%%edx\n"	/* tf_eip */
+			"\tmovl 20(%%esp),%%ecx\n"	/* tf_esp */
+			"\taddl $0x4,%%esp\n"		/* skip tf_trapno */
+			"\tpopfl\n"			/* tf_err: the flags */
+			"\tsti\n"
+			"\tsysexit\n"
+			: : "g" (tf) : "memory");
+	}
+
 	asm volatile(
 		"\tmovl %0,%%esp\n"
 		"\tpopal\n"
@@ -613,37 +762,46 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-    if (curenv != NULL && curenv->env_status == ENV_RUNNING) {
+    // Switching environments only happens from sched_yield(), under the
+    // kernel lock.  Returning to curenv after a trap may not hold it, so
+    // that path must leave env_status alone: another CPU may be marking
+    // curenv ENV_DYING right now.
+    // Put away the FPU registers of the environment we switch from
+    // while we still hold the kernel lock, before any other CPU can
+    // pick it up.
+    if (curenv != e) {
+        fpu_save();
+        fpu_switch(e);
+        if (curenv != NULL) {
+            sched_account(curenv);
+        }
+        e->env_run_start = read_tsc();
+    }
+    if (curenv != NULL && curenv != e && curenv->env_status == ENV_RUNNING) {
         curenv->env_status = ENV_RUNNABLE;
         curenv->env_runs -= 1;
+        // preempted: back to the tail of this CPU's run queue
+        sched_enqueue(curenv);
     }
     
-    // validating all the breakpoints except for the current one
-    for (size_t i = 0; i < e->bpnum; i++) {
-        struct PageInfo *pp;
-        uintptr_t bp_va = e->bp[i].va;
-        if ((pp = page_lookup(e->env_pgdir, (void *)bp_va, 0)) == NULL) {
-            cprintf("warning: unreachable breakpoint at 0x%x\n", bp_va);
-            continue;
-        }
-        if (e->env_tf.tf_trapno == T_BRKPT && bp_va == e->env_tf.tf_eip) {
-            continue;
-        }
-        unsigned char *victim = page2kva(pp) + PGOFF(bp_va); 
-        e->bp[i].victim = *victim;
-        *victim = 0xcc;
-    }
-
+    env_load_debugregs(e);
 
-    curenv = e;
-    curenv->env_status = ENV_RUNNING;
-    curenv->env_runs += 1;
+    if (curenv != e || e->env_status == ENV_RUNNABLE) {
+        curenv = e;
+        curenv->env_status = ENV_RUNNING;
+        curenv->env_runs += 1;
+    }
     // Restores the paging.
     // Since the user mapping above UTOP is identical to 
     // that of the kernel, it is ok to dereference e.
-    lcr3(PADDR(curenv->env_pgdir));
+    pgdir_load(curenv->env_pgdir);
     env_tf = &curenv->env_tf;
-    unlock_kernel();
+    if (spin_holding(&kernel_lock)) {
+        unlock_kernel();
+    }
+    tlb_shootdown_flush();
+    spin_assert_none_held();
+    kstat_stop();
     // switch back to the user mode
     env_pop_tf(env_tf);
 }
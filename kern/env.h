@@ -18,12 +18,47 @@ void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+
+// Per-environment locks (see kern/spinlock.h for the lock order).
+// env_lock_vm guards env_pgdir, exec_pgdir and everything mapped in
+// them; env_lock_ipc guards the env_ipc_* fields.  The vm variants
+// take the envid the caller looked e up by and fail with -E_BAD_ENV,
+// holding nothing, if e was freed while they waited.
+int	env_lock_vm(struct Env *e, envid_t envid);
+int	env_lock_vm2(struct Env *a, envid_t aid, struct Env *b, envid_t bid);
+void	env_unlock_vm(struct Env *e);
+void	env_unlock_vm2(struct Env *a, struct Env *b);
+void	env_lock_ipc(struct Env *e);
+void	env_unlock_ipc(struct Env *e);
+
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
 
-int     env_breakpoints_alloc(struct Env *e);
-void    env_breakpoints_remove(struct Env *e);
+// Messages sent to an environment that is not in sys_ipc_recv wait in
+// its queue, allocated on the first such send.  The queue belongs to
+// env_lock_ipc.
+#define IPC_QUEUE_LEN	8
+
+struct IpcMsg {
+	envid_t im_from;
+	uint32_t im_value;
+	struct PageInfo *im_page;	// Page sent, holding a reference; or NULL
+	struct PageInfo **im_pages;	// The im_npages pages sent: &im_page
+					// for one, else a kmalloc'd array
+	int im_npages;
+	int im_perm;
+};
+
+struct IpcQueue {
+	struct IpcMsg iq_msgs[IPC_QUEUE_LEN];
+	int iq_head;			// Index of the oldest message
+	int iq_count;
+};
+
+void	env_ipc_queue_free(struct Env *e);
+
+void    env_load_debugregs(struct Env *e);
 int     env_alloc_pgdir(pde_t **pgdir_store);
 void    env_free_pgdir(pde_t *pgdir);
 
@@ -0,0 +1,140 @@
+// Lazy FPU and SSE context switching.
+//
+// An environment gets an FXSAVE area the first time it uses the FPU.
+// While its registers are not loaded on this CPU, CR0.TS is set, so
+// its next FPU or SSE instruction raises T_DEVICE and fpu_trap loads
+// them.  Environments that never touch the FPU never pay for a save
+// or a restore.
+//
+// A CPU saves the registers when it switches away from an environment
+// that has them loaded (fpu_save), before it drops the kernel lock, so
+// a CPU that picks the environment up later finds them in env_fpu.
+// If it comes back to the same CPU and nobody loaded theirs meanwhile,
+// the registers are still there and fpu_switch just clears CR0.TS.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/fpu.h>
+#include <kern/kmalloc.h>
+
+// Whether the CPUs have fxsave and SSE.  Without them CR0.EM stays
+// set and any FPU instruction kills the environment.
+static bool fpu_fxsr;
+
+// What a new environment starts with: the fninit control word, all
+// SSE exceptions masked and every register zero.
+static struct FpuState fpu_initstate = {
+    .fs_fcw = 0x037f,
+    .fs_mxcsr = 0x1f80,
+};
+
+void
+fpu_init_percpu(void)
+{
+    uint32_t edx, cr0;
+
+    cpuid(1, NULL, NULL, NULL, &edx);
+    fpu_fxsr = (edx & CPUID_EDX_FXSR) && (edx & CPUID_EDX_SSE);
+
+    cr0 = rcr0() | CR0_MP | CR0_NE | CR0_TS;
+    if (fpu_fxsr) {
+        lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+        cr0 &= ~CR0_EM;
+    } else {
+        cr0 |= CR0_EM;
+    }
+    lcr0(cr0);
+    thiscpu->cpu_fpu_envid = 0;
+    thiscpu->cpu_fpu_loaded = false;
+}
+
+// Handle T_DEVICE: load curenv's registers, first allocating them if
+// this is its first FPU instruction.
+// Returns -E_NO_MEM if the FXSAVE area cannot be allocated, or
+// -E_INVAL if the CPU cannot save FPU state.
+int
+fpu_trap(void)
+{
+    struct Env *e = curenv;
+
+    if (!fpu_fxsr) {
+        return -E_INVAL;
+    }
+    if (e->env_fpu == NULL) {
+        if ((e->env_fpu = kmalloc(sizeof(struct FpuState), 0)) == NULL) {
+            return -E_NO_MEM;
+        }
+        *e->env_fpu = fpu_initstate;
+    }
+    clts();
+    fxrstor(e->env_fpu);
+    e->env_fpu_cpu = cpunum();
+    thiscpu->cpu_fpu_envid = e->env_id;
+    thiscpu->cpu_fpu_loaded = true;
+    return 0;
+}
+
+// Save curenv's registers if they are loaded, because this CPU is
+// switching away from it, and set CR0.TS again.
+void
+fpu_save(void)
+{
+    if (!thiscpu->cpu_fpu_loaded) {
+        return;
+    }
+    fxsave(curenv->env_fpu);
+    lcr0(rcr0() | CR0_TS);
+    thiscpu->cpu_fpu_loaded = false;
+}
+
+// Prepare to run e, which this CPU is switching to, after fpu_save.
+// If e's registers are still loaded here, let it use them at once.
+void
+fpu_switch(struct Env *e)
+{
+    if (e->env_fpu != NULL && e->env_fpu_cpu == cpunum() &&
+        thiscpu->cpu_fpu_envid == e->env_id) {
+        clts();
+        thiscpu->cpu_fpu_loaded = true;
+    }
+}
+
+// Give child, which curenv is forking, a copy of curenv's registers.
+// Returns -E_NO_MEM if the FXSAVE area cannot be allocated.
+int
+fpu_fork(struct Env *child)
+{
+    struct Env *e = curenv;
+
+    if (e->env_fpu == NULL) {
+        return 0;
+    }
+    // Bring env_fpu up to date, leaving the registers loaded.
+    if (thiscpu->cpu_fpu_loaded) {
+        fxsave(e->env_fpu);
+    }
+    if ((child->env_fpu = kmalloc(sizeof(struct FpuState), 0)) == NULL) {
+        return -E_NO_MEM;
+    }
+    *child->env_fpu = *e->env_fpu;
+    return 0;
+}
+
+// Release e's FXSAVE area.  e must not be running on another CPU.
+void
+fpu_free(struct Env *e)
+{
+    if (e == curenv && thiscpu->cpu_fpu_loaded) {
+        lcr0(rcr0() | CR0_TS);
+        thiscpu->cpu_fpu_loaded = false;
+    }
+    if (e->env_fpu != NULL) {
+        kfree(e->env_fpu);
+        e->env_fpu = NULL;
+    }
+}
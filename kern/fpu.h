@@ -0,0 +1,19 @@
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+// Lazy FPU and SSE context switching.
+void	fpu_init_percpu(void);
+int	fpu_trap(void);
+void	fpu_switch(struct Env *e);
+void	fpu_save(void);
+int	fpu_fork(struct Env *child);
+void	fpu_free(struct Env *e);
+
+#endif	// !JOS_KERN_FPU_H
@@ -8,9 +8,11 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
+#include <kern/fpu.h>
 #include <kern/sched.h>
 #include <kern/picirq.h>
 #include <kern/cpu.h>
@@ -32,10 +34,12 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kmem_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
 	trap_init();
+	fpu_init_percpu();
 
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
@@ -114,12 +118,13 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
-	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
 	env_init_percpu();
 	trap_init_percpu();
+	fpu_init_percpu();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
@@ -0,0 +1,260 @@
+// Slab allocator for small kernel objects.
+//
+// A slab is a block of 1 << km_order pages from page_alloc_npages whose
+// first bytes hold a struct Slab and whose remainder is carved into
+// objects of one size.  Every page of a slab is marked PP_SLAB with the
+// slab's order in pp_order, so kfree can find the slab header from any
+// object.  In front of each cache, every CPU keeps a magazine of free
+// objects and only takes the cache lock to move KMEM_BATCH of them at a
+// time, like the per-CPU page caches in pmap.c.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+
+struct Slab {
+	struct KmemCache *s_cache;
+	struct Slab *s_next;		// On s_cache->km_partial
+	struct Slab *s_prev;
+	void *s_free;			// Free objects, linked through
+					// their first word
+	int s_inuse;			// Objects handed out
+};
+
+// Offset of the first object in a slab.
+#define SLAB_HDR	ROUNDUP(sizeof(struct Slab), KMEM_MIN_SIZE)
+
+struct KmemCache kmem_caches[KMEM_NCACHES];
+uint32_t kmem_large_pages;	// Pages held by allocations > KMEM_MAX_SIZE
+
+void
+kmem_init(void)
+{
+    for (int i = 0; i < KMEM_NCACHES; i++) {
+        struct KmemCache *km = &kmem_caches[i];
+        size_t slab;
+
+        km->km_size = KMEM_MIN_SIZE << i;
+        // Grow the slab until at most 1/8 of it is wasted.
+        for (km->km_order = 0; ; km->km_order++) {
+            slab = PGSIZE << km->km_order;
+            if ((slab - SLAB_HDR) % km->km_size <= slab / 8) {
+                break;
+            }
+        }
+        km->km_perslab = (slab - SLAB_HDR) / km->km_size;
+        __spin_initlock(&km->km_lock, "kmem_cache_lock", LOCK_RANK_KMEM);
+        for (int j = 0; j < NCPU; j++) {
+            __spin_initlock(&km->km_cpu[j].kc_lock, "kmem_cpu_lock",
+                            LOCK_RANK_KMEMCPU);
+        }
+    }
+}
+
+static void
+slab_link(struct KmemCache *km, struct Slab *s)
+{
+    s->s_prev = NULL;
+    s->s_next = km->km_partial;
+    if (s->s_next != NULL) {
+        s->s_next->s_prev = s;
+    }
+    km->km_partial = s;
+}
+
+static void
+slab_unlink(struct KmemCache *km, struct Slab *s)
+{
+    if (s->s_prev != NULL) {
+        s->s_prev->s_next = s->s_next;
+    } else {
+        km->km_partial = s->s_next;
+    }
+    if (s->s_next != NULL) {
+        s->s_next->s_prev = s->s_prev;
+    }
+    s->s_next = s->s_prev = NULL;
+}
+
+// Allocate a new, empty slab for km and put it on km_partial.
+// The caller holds km->km_lock.
+static struct Slab *
+slab_create(struct KmemCache *km)
+{
+    struct PageInfo *pp;
+    struct Slab *s;
+    char *obj;
+    int i;
+
+    if ((pp = page_alloc_npages(km->km_order, 0)) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < (1 << km->km_order); i++) {
+        pp[i].pp_flags |= PP_SLAB;
+        pp[i].pp_order = km->km_order;
+    }
+    s = page2kva(pp);
+    s->s_cache = km;
+    s->s_inuse = 0;
+    s->s_free = NULL;
+    obj = (char *)s + SLAB_HDR;
+    for (i = 0; i < km->km_perslab; i++, obj += km->km_size) {
+        *(void **)obj = s->s_free;
+        s->s_free = obj;
+    }
+    slab_link(km, s);
+    km->km_nslabs++;
+    return s;
+}
+
+// Give an empty slab back to the page allocator.
+// The caller holds km->km_lock.
+static void
+slab_destroy(struct KmemCache *km, struct Slab *s)
+{
+    struct PageInfo *pp = pa2page(PADDR(s));
+
+    slab_unlink(km, s);
+    for (int i = 0; i < (1 << km->km_order); i++) {
+        pp[i].pp_flags &= ~PP_SLAB;
+    }
+    page_free_npages(pp, km->km_order);
+    km->km_nslabs--;
+}
+
+// Move up to KMEM_BATCH objects from km's slabs into kc.
+// The caller holds kc->kc_lock.
+static void
+kmem_refill(struct KmemCache *km, struct KmemCpu *kc)
+{
+    struct Slab *s;
+    void *obj;
+
+    spin_lock(&km->km_lock);
+    while (kc->kc_count < KMEM_BATCH) {
+        if ((s = km->km_partial) == NULL && (s = slab_create(km)) == NULL) {
+            break;
+        }
+        obj = s->s_free;
+        s->s_free = *(void **)obj;
+        s->s_inuse++;
+        km->km_inuse++;
+        if (s->s_free == NULL) {
+            slab_unlink(km, s);
+        }
+        kc->kc_objs[kc->kc_count++] = obj;
+    }
+    spin_unlock(&km->km_lock);
+}
+
+// Return up to n objects from kc to their slabs, freeing slabs that
+// become empty unless they are the only partial slab left.
+// The caller holds kc->kc_lock.
+static void
+kmem_flush(struct KmemCache *km, struct KmemCpu *kc, int n)
+{
+    struct Slab *s;
+    void *obj;
+
+    spin_lock(&km->km_lock);
+    for (; n > 0 && kc->kc_count > 0; n--) {
+        obj = kc->kc_objs[--kc->kc_count];
+        s = ROUNDDOWN(obj, PGSIZE << km->km_order);
+        if (s->s_free == NULL) {
+            slab_link(km, s);
+        }
+        *(void **)obj = s->s_free;
+        s->s_free = obj;
+        s->s_inuse--;
+        km->km_inuse--;
+        if (s->s_inuse == 0 && (s->s_prev != NULL || s->s_next != NULL)) {
+            slab_destroy(km, s);
+        }
+    }
+    spin_unlock(&km->km_lock);
+}
+
+//
+// Allocates size bytes of kernel memory, aligned to KMEM_MIN_SIZE (to
+// PGSIZE if size > KMEM_MAX_SIZE).  Honors ALLOC_ZERO like page_alloc.
+// Only available once mem_init is done.
+//
+// Returns NULL if out of memory.
+//
+void *
+kmalloc(size_t size, int alloc_flags)
+{
+    struct KmemCache *km;
+    struct KmemCpu *kc;
+    struct PageInfo *pp;
+    void *obj = NULL;
+    int i, order;
+
+    if (size > KMEM_MAX_SIZE) {
+        for (order = 0; (PGSIZE << order) < size; order++) {
+            ;
+        }
+        if ((pp = page_alloc_npages(order, alloc_flags)) == NULL) {
+            return NULL;
+        }
+        // kfree finds the size here.
+        pp->pp_order = order;
+        __sync_fetch_and_add(&kmem_large_pages, 1 << order);
+        return page2kva(pp);
+    }
+
+    for (i = 0; (KMEM_MIN_SIZE << i) < size; i++) {
+        ;
+    }
+    km = &kmem_caches[i];
+    kc = &km->km_cpu[cpunum()];
+    spin_lock(&kc->kc_lock);
+    if (kc->kc_count == 0) {
+        kmem_refill(km, kc);
+    }
+    if (kc->kc_count > 0) {
+        obj = kc->kc_objs[--kc->kc_count];
+        kc->kc_allocs++;
+    }
+    spin_unlock(&kc->kc_lock);
+    if (obj != NULL && (alloc_flags & ALLOC_ZERO)) {
+        memset(obj, 0, km->km_size);
+    }
+    return obj;
+}
+
+//
+// Frees memory returned by kmalloc.  kfree(NULL) does nothing.
+//
+void
+kfree(void *p)
+{
+    struct KmemCache *km;
+    struct KmemCpu *kc;
+    struct PageInfo *pp;
+    struct Slab *s;
+
+    if (p == NULL) {
+        return;
+    }
+    pp = pa2page(PADDR(p));
+    if (!(pp->pp_flags & PP_SLAB)) {
+        assert(PGOFF(p) == 0);
+        __sync_fetch_and_sub(&kmem_large_pages, 1 << pp->pp_order);
+        page_free_npages(pp, pp->pp_order);
+        return;
+    }
+
+    s = ROUNDDOWN(p, PGSIZE << pp->pp_order);
+    km = s->s_cache;
+    kc = &km->km_cpu[cpunum()];
+    spin_lock(&kc->kc_lock);
+    if (kc->kc_count == KMEM_MAG) {
+        kmem_flush(km, kc, KMEM_BATCH);
+    }
+    kc->kc_objs[kc->kc_count++] = p;
+    kc->kc_frees++;
+    spin_unlock(&kc->kc_lock);
+}
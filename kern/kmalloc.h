@@ -0,0 +1,53 @@
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Slab allocator for small kernel objects.  Each power-of-two size from
+// KMEM_MIN_SIZE to KMEM_MAX_SIZE has its own cache of slabs; bigger
+// requests go straight to page_alloc_npages.
+#define KMEM_MIN_SHIFT	4
+#define KMEM_MAX_SHIFT	11
+#define KMEM_MIN_SIZE	(1 << KMEM_MIN_SHIFT)	// Also the object alignment
+#define KMEM_MAX_SIZE	(1 << KMEM_MAX_SHIFT)
+#define KMEM_NCACHES	(KMEM_MAX_SHIFT - KMEM_MIN_SHIFT + 1)
+
+// Per-CPU magazine of free objects in front of each cache.
+#define KMEM_MAG	32	// Objects a magazine holds
+#define KMEM_BATCH	16	// Objects moved per refill or flush
+
+struct KmemCpu {
+	struct spinlock kc_lock;
+	void *kc_objs[KMEM_MAG];
+	int kc_count;
+	// Statistics, shown by the monitor's "slab" command
+	uint32_t kc_allocs;
+	uint32_t kc_frees;
+};
+
+struct KmemCache {
+	struct spinlock km_lock;
+	size_t km_size;			// Object size
+	int km_order;			// Each slab is 1 << km_order pages
+	int km_perslab;			// Objects per slab
+	struct Slab *km_partial;	// Slabs with free objects
+	// Statistics, shown by the monitor's "slab" command
+	uint32_t km_nslabs;		// Slabs allocated
+	uint32_t km_inuse;		// Objects out of the slabs, including
+					// those parked in the magazines
+	struct KmemCpu km_cpu[NCPU];
+};
+
+extern struct KmemCache kmem_caches[KMEM_NCACHES];
+extern uint32_t kmem_large_pages;
+
+void	kmem_init(void);
+void *	kmalloc(size_t size, int alloc_flags);
+void	kfree(void *p);
+
+#endif	// !JOS_KERN_KMALLOC_H
@@ -0,0 +1,88 @@
+// Kernel latency statistics (see inc/kstats.h).
+//
+// trap_dispatch starts this CPU's clock for each trap, and syscall
+// notes which system call the trap runs.  The clock stops when the CPU
+// next leaves the kernel, in env_run or sched_halt, so a trap that
+// blocks or switches to another environment counts the time until
+// then.  Each CPU writes only its own table, without locks.
+
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/kstats.h>
+
+struct Kstats *kstats;
+
+// The event being timed on each CPU.
+struct KstatClock {
+    uint64_t kc_start;                  // TSC when the trap came in
+    struct KstatHist *kc_trap;          // Where to count it, or NULL
+    struct KstatHist *kc_syscall;       // Also here, for a system call
+};
+
+static struct KstatClock kstat_clocks[NCPU];
+
+// Start timing a trap on this CPU.
+void
+kstat_trap(uint32_t trapno)
+{
+    int cpu = cpunum();
+    struct KstatClock *kc = &kstat_clocks[cpu];
+
+    kc->kc_start = read_tsc();
+    kc->kc_trap = trapno < KSTAT_NTRAP ? &kstats[cpu].ks_trap[trapno] : NULL;
+    kc->kc_syscall = NULL;
+}
+
+// Count the trap being timed as system call syscallno as well.
+void
+kstat_syscall(uint32_t syscallno)
+{
+    int cpu = cpunum();
+
+    if (syscallno < KSTAT_NSYSCALL) {
+        kstat_clocks[cpu].kc_syscall = &kstats[cpu].ks_syscall[syscallno];
+    }
+}
+
+static void
+kstat_count(struct KstatHist *kh, uint64_t cycles)
+{
+    uint32_t c = cycles > 0xffffffff ? 0xffffffff : (uint32_t) cycles;
+
+    kh->kh_count++;
+    kh->kh_cycles += cycles;
+    if (cycles > kh->kh_max) {
+        kh->kh_max = cycles;
+    }
+    kh->kh_bucket[c ? 31 - __builtin_clz(c) : 0]++;
+}
+
+// This CPU is leaving the kernel: count the trap being timed, if any.
+void
+kstat_stop(void)
+{
+    struct KstatClock *kc = &kstat_clocks[cpunum()];
+    uint64_t cycles;
+
+    if (kc->kc_trap == NULL && kc->kc_syscall == NULL) {
+        return;
+    }
+    cycles = read_tsc() - kc->kc_start;
+    if (kc->kc_trap != NULL) {
+        kstat_count(kc->kc_trap, cycles);
+    }
+    if (kc->kc_syscall != NULL) {
+        kstat_count(kc->kc_syscall, cycles);
+    }
+    kc->kc_trap = kc->kc_syscall = NULL;
+}
+
+// Zero every CPU's table.  Counts that other CPUs are updating at the
+// same time may survive.
+void
+kstat_reset(void)
+{
+    memset(kstats, 0, NCPU * sizeof(struct Kstats));
+}
@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_KSTATS_H
+#define JOS_KERN_KSTATS_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/kstats.h>
+
+extern struct Kstats *kstats;		// NCPU tables, mapped at UKSTATS
+
+void	kstat_trap(uint32_t trapno);
+void	kstat_syscall(uint32_t syscallno);
+void	kstat_stop(void);
+void	kstat_reset(void);
+
+#endif	// !JOS_KERN_KSTATS_H
@@ -7,6 +7,7 @@
 #include <inc/mmu.h>
 #include <inc/stdio.h>
 #include <inc/x86.h>
+#include <inc/string.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
 
@@ -45,6 +46,15 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// TLB invalidations other CPUs have asked of this one (see tlb_shootdown).
+static struct Shootdown {
+	struct spinlock sd_lock;
+	uintptr_t sd_va[TLB_SHOOTDOWN_MAX];
+	int sd_nva;			// > TLB_SHOOTDOWN_MAX: flush everything
+	volatile uint32_t sd_posted;	// Requests posted so far
+	volatile uint32_t sd_done;	// Requests handled so far
+} shootdowns[NCPU];
+
 static void
 lapicw(int index, int value)
 {
@@ -61,6 +71,8 @@ lapic_init(void)
 	// lapicaddr is the physical address of the LAPIC's 4K MMIO
 	// region.  Map it in to virtual memory so we can access it.
 	lapic = mmio_map_region(lapicaddr, 4096);
+	__spin_initlock(&shootdowns[cpunum()].sd_lock, "shootdown_lock",
+			LOCK_RANK_SHOOTDOWN);
 
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
@@ -70,8 +82,7 @@ lapic_init(void)
 	// If we cared more about precise timekeeping,
 	// TICR would be calibrated using an external time source.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	lapic_timer_periodic();
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -119,6 +130,37 @@ cpunum(void)
 	return 0;
 }
 
+// Timer counts per millisecond, assuming the 1GHz bus QEMU emulates.
+#define TIMER_PER_MSEC	1000000
+// Period of the scheduler tick
+#define TICK_MSEC	10
+
+// Interrupt every TICK_MSEC, while this CPU runs environments.
+void
+lapic_timer_periodic(void)
+{
+	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, TICK_MSEC * TIMER_PER_MSEC);
+}
+
+// Interrupt once, msec milliseconds from now, and then stay quiet.
+void
+lapic_timer_oneshot(unsigned int msec)
+{
+	// Keep the count within 32 bits; waking early does no harm.
+	msec = MIN(MAX(msec, 1), 4000);
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, msec * TIMER_PER_MSEC);
+}
+
+// Stop the timer.
+void
+lapic_timer_stop(void)
+{
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0);
+}
+
 // Acknowledge interrupt.
 void
 lapic_eoi(void)
@@ -180,3 +222,105 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Return the mask of other CPUs that have pgdir loaded, and may thus
+// cache translations from it.  Call this after updating the PTEs: a CPU
+// that loads pgdir later sees the new entries anyway.
+uint32_t
+tlb_shootdown_cpus(pde_t *pgdir)
+{
+	uint32_t mask = 0;
+	int i, me = cpunum();
+
+	// Order the PTE stores before the loads of cpu_pgdir.  Pairs with
+	// the serializing CR3 load in pgdir_load.
+	asm volatile("lock; addl $0,0(%%esp)" : : : "cc", "memory");
+	for (i = 0; i < ncpu; i++)
+		if (i != me && cpus[i].cpu_pgdir == pgdir)
+			mask |= 1 << i;
+	return mask;
+}
+
+// Have the CPUs in cpumask invalidate the nva addresses in va, or
+// flush their whole TLB if nva > TLB_SHOOTDOWN_MAX, and wait until
+// they have.  Sends one IPI per target CPU.
+//
+// Targets only take the IPI with interrupts enabled, so the caller
+// must hold no locks: a target spinning on one would never answer.
+// While waiting we serve requests aimed at us, so that two CPUs
+// shooting at each other do not deadlock.  A target that reloads CR3
+// meanwhile has flushed its TLB and need not be waited for.
+void
+tlb_shootdown(uint32_t cpumask, const uintptr_t *va, int nva)
+{
+	uint32_t ticket[NCPU], loads[NCPU];
+	struct Shootdown *sd;
+	int i, j;
+
+	for (i = 0; i < ncpu; i++) {
+		if (!(cpumask & (1 << i)))
+			continue;
+		sd = &shootdowns[i];
+		loads[i] = cpus[i].cpu_cr3_loads;
+		spin_lock(&sd->sd_lock);
+		if (nva > TLB_SHOOTDOWN_MAX ||
+		    sd->sd_nva + nva > TLB_SHOOTDOWN_MAX)
+			sd->sd_nva = TLB_SHOOTDOWN_MAX + 1;
+		else {
+			for (j = 0; j < nva; j++)
+				sd->sd_va[sd->sd_nva + j] = va[j];
+			sd->sd_nva += nva;
+		}
+		ticket[i] = ++sd->sd_posted;
+		spin_unlock(&sd->sd_lock);
+		lapic_ipi_cpu(cpus[i].cpu_id, IRQ_OFFSET + IRQ_TLB);
+	}
+
+	for (i = 0; i < ncpu; i++) {
+		if (!(cpumask & (1 << i)))
+			continue;
+		sd = &shootdowns[i];
+		while ((int32_t)(sd->sd_done - ticket[i]) < 0 &&
+		       cpus[i].cpu_cr3_loads == loads[i]) {
+			tlb_shootdown_intr();
+			asm volatile("pause");
+		}
+	}
+}
+
+// Carry out the invalidations posted to this CPU.  Called from the
+// IRQ_TLB handler and while waiting in tlb_shootdown.
+void
+tlb_shootdown_intr(void)
+{
+	struct Shootdown *sd = &shootdowns[cpunum()];
+	uintptr_t va[TLB_SHOOTDOWN_MAX];
+	uint32_t posted;
+	int i, nva;
+
+	if (sd->sd_done == sd->sd_posted)
+		return;
+	spin_lock(&sd->sd_lock);
+	nva = sd->sd_nva;
+	if (nva <= TLB_SHOOTDOWN_MAX)
+		memcpy(va, sd->sd_va, nva * sizeof(uintptr_t));
+	posted = sd->sd_posted;
+	sd->sd_nva = 0;
+	spin_unlock(&sd->sd_lock);
+
+	if (nva > TLB_SHOOTDOWN_MAX)
+		lcr3(rcr3());
+	else
+		for (i = 0; i < nva; i++)
+			invlpg((void *)va[i]);
+	sd->sd_done = posted;
+}
@@ -11,10 +11,12 @@
 #include <kern/console.h>
 #include <kern/monitor.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/env.h>
 #include <kern/sched.h>
+#include <kern/kstats.h>
 
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
@@ -34,6 +36,9 @@ static struct Command commands[] = {
     { "vmmaps", "Display all of the physical page mappings that apply to a particular range of virtual/linear addresses", mon_vmmaps},
     { "setperm", "Set the permission of a page entry specified by virtual/linear address va", mon_setperm},
     { "dump", "Dump the n bytes at virtual address.", mon_dump},
+    { "pagecache", "Display the per-CPU free page caches and buddy free lists", mon_pagecache},
+    { "slab", "Display the kmalloc slab caches", mon_slab},
+    { "kstats", "Display trap and system call latencies, or reset them", mon_kstats},
 
     { "break", "Set breakpoint", mon_break },
     { "b", "alias of break", mon_break },
@@ -127,7 +132,7 @@ mon_vmmaps(int argc, char **argv, struct Trapframe *tf)
             size_t pdx = PDX(va);
             size_t ptx = PTX(va);
             size_t pgoff = PGOFF(va);
-            physaddr_t pa = pgoff + PTE_ADDR(*pte);
+            physaddr_t pa = pgoff + pte_pa(*pte, (void *)va);
             char perm[] = {0};
             if (*pte & PTE_P) {
                 strcat(perm, "P");
@@ -233,7 +238,7 @@ mon_dump(int argc, char **argv, struct Trapframe *tf)
     int printed = 0;
     while ((pte = pgdir_walk(curenv->env_pgdir, (void *)p, 0)) != NULL && *pte != 0) {
         uint32_t pgoff = PGOFF((void *)p);
-        physaddr_t pa = PTE_ADDR(*pte) + pgoff;
+        physaddr_t pa = pte_pa(*pte, (void *)p) + pgoff;
         unsigned char *va = KADDR(pa);
         for (; pgoff < PGSIZE && count != 0; p++, pgoff++, count--) {
             cprintf("%d ", *va++);
@@ -253,6 +258,68 @@ mon_dump(int argc, char **argv, struct Trapframe *tf)
     return -1;
 }
 
+int
+mon_pagecache(int argc, char **argv, struct Trapframe *tf)
+{
+    cprintf("%3s%8s%10s%10s%9s%9s%10s%10s%8s\n", 
+            "cpu", "cached", "allocs", "frees", "refills", "drains",
+            "zerohits", "zeromiss", "zeroed");
+    for (int i = 0; i < ncpu; i++) {
+        struct PageCache *pc = &page_caches[i];
+        cprintf("%3d%8d%10u%10u%9u%9u%10u%10u%8u\n", i, pc->pc_count, 
+                pc->pc_allocs, pc->pc_frees, pc->pc_refills, pc->pc_drains,
+                pc->pc_zero_hits, pc->pc_zero_misses, pc->pc_zeroed);
+    }
+    cprintf("pre-zeroed pool: %d pages\n", page_zero_count);
+    cprintf("buddy free blocks by order:");
+    for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        cprintf(" %u", buddy_nfree[i]);
+    }
+    cprintf("\n");
+    return 0;
+}
+
+int
+mon_slab(int argc, char **argv, struct Trapframe *tf)
+{
+    cprintf("%6s%6s%8s%8s%8s%7s%8s%10s%10s\n",
+            "size", "order", "slabs", "inuse", "total", "util", "cached",
+            "allocs", "frees");
+    for (int i = 0; i < KMEM_NCACHES; i++) {
+        struct KmemCache *km = &kmem_caches[i];
+        uint32_t total = km->km_nslabs * km->km_perslab;
+        uint32_t allocs = 0, frees = 0;
+        int cached = 0;
+        for (int j = 0; j < ncpu; j++) {
+            cached += km->km_cpu[j].kc_count;
+            allocs += km->km_cpu[j].kc_allocs;
+            frees += km->km_cpu[j].kc_frees;
+        }
+        // Objects parked in the magazines count as free here.
+        cprintf("%6u%6d%8u%8u%8u%6u%%%8d%10u%10u\n", km->km_size,
+                km->km_order, km->km_nslabs, km->km_inuse - cached, total,
+                total ? (km->km_inuse - cached) * 100 / total : 0, cached,
+                allocs, frees);
+    }
+    cprintf("large allocations: %u pages\n", kmem_large_pages);
+    return 0;
+}
+
+int
+mon_kstats(int argc, char **argv, struct Trapframe *tf)
+{
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        kstat_reset();
+        return 0;
+    }
+    if (argc != 1) {
+        cprintf("usage: kstats [reset]\n");
+        return 0;
+    }
+    kstats_print(kstats, ncpu);
+    return 0;
+}
+
 
 int mon_stepi(int argc, char **argv, struct Trapframe *tf) {
     if (argc != 1) {
@@ -290,7 +357,8 @@ int mon_continue(int argc, char **argv, struct Trapframe *tf) {
     return -1;
 }
 
-// env_run is responsible for validating the breakpoints
+// Breakpoints live in the debug registers, so code pages are never
+// patched: env_run loads them whenever the environment runs.
 int mon_break(int argc, char **argv, struct Trapframe *tf) {
     int err;
     if (argc != 2) {
@@ -311,36 +379,20 @@ int mon_break(int argc, char **argv, struct Trapframe *tf) {
         cprintf("warning: invalid breakpoint %x\n", va);
         return 0;
     }
-    struct PageInfo *pp;
-    if ((pp = page_lookup(curenv->env_pgdir, va, NULL)) == NULL) {
-        cprintf("warning: invalid breakpoint %x\n", va);
-        return 0;
-    }
-    if (curenv->bp == NULL) {
-        if ((err = env_breakpoints_alloc(curenv))) {
-            return err;
-        }
-    }
-    if (curenv->bpnum > MAX_BREAKPOINTS) {
+    if (curenv->bpnum >= MAX_BREAKPOINTS) {
         cprintf("too many breakpoints\n");
         return -1;
     }
     for (size_t i = 0; i < curenv->bpnum; i++) {
-        if (curenv->bp[i].va == (uintptr_t)va) {
+        if (curenv->bp[i] == (uintptr_t)va) {
             cprintf("warning: duplicated breakpoint at 0x%x\n", va);
             return 0;
         }
     }
-    unsigned char *victim = page2kva(pp) + PGOFF(va);
-    if (*victim == 0xcc) {
-        cprintf("warning: duplicated breakpoint at 0x%x\n", va);
-        return 0;
-    }
-    struct BreakPoint bp = {
-        (uintptr_t)va,
-        *victim,
-    };
-    curenv->bp[curenv->bpnum++] = bp;
+    curenv->bp[curenv->bpnum] = (uintptr_t)va;
+    curenv->env_dr7 |= DR7_L(curenv->bpnum);
+    curenv->bpnum++;
+    env_load_debugregs(curenv);
     return 0;
 }
 
@@ -18,6 +18,9 @@ int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 int mon_vmmaps(int argc, char **argv, struct Trapframe *tf);
 int mon_setperm(int argc, char **argv, struct Trapframe *tf);
 int mon_dump(int argc, char **argv, struct Trapframe *tf);
+int mon_pagecache(int argc, char **argv, struct Trapframe *tf);
+int mon_slab(int argc, char **argv, struct Trapframe *tf);
+int mon_kstats(int argc, char **argv, struct Trapframe *tf);
 
 int mon_stepi(int argc, char **argv, struct Trapframe *tf);
 int mon_continue(int argc, char **argv, struct Trapframe *tf);
@@ -11,6 +11,8 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/kstats.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -19,7 +21,43 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
+static bool page_pse;		// Whether CR4_PSE is on (4MB pages)
+static size_t page_pse_ptables;	// Page tables saved by 4MB mappings
 static struct PageInfo *page_free_list;	// Free list of physical pages
+static struct spinlock page_lock =	// Protects page_free_list and
+	SPINLOCK_INIT(page_lock, LOCK_RANK_PAGE);	// the buddy allocator
+
+// Per-CPU magazines of free pages in front of the buddy allocator, which
+// takes over the free pages from page_free_list.  Both are enabled at
+// the end of mem_init, once the checks that inspect page_free_list
+// directly are done.
+struct PageCache page_caches[NCPU];
+static bool page_caches_enabled;
+
+// Buddy allocator free lists: blocks of 1 << order pages, aligned to
+// their size and doubly linked by pp_link and pp_prev.
+static struct PageInfo *buddy_free_area[BUDDY_MAX_ORDER + 1];
+size_t buddy_nfree[BUDDY_MAX_ORDER + 1];	// Blocks on each list
+static size_t buddy_npages;			// Pages on all lists
+
+// Per-CPU deferred TLB invalidation (see tlb_batch_begin and
+// tlb_shootdown_flush).
+static struct TlbBatch {
+	bool tb_active;
+	bool tb_pending;
+	// Invalidations owed to other CPUs running on the same page tables
+	uint32_t tb_cpus;
+	uintptr_t tb_va[TLB_SHOOTDOWN_MAX];
+	int tb_nva;			// > TLB_SHOOTDOWN_MAX: flush everything
+	struct PageInfo *tb_free;	// Pages to free once they are sent
+} tlb_batch[NCPU];
+
+// Pool of pre-zeroed free pages, filled by idle CPUs (page_zero_idle)
+// and consumed first by ALLOC_ZERO allocations.
+static struct PageInfo *page_zero_list;
+int page_zero_count;
+static struct spinlock page_zero_lock =
+	SPINLOCK_INIT(page_zero_lock, LOCK_RANK_PAGE);
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -64,6 +102,7 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static void buddy_init(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
@@ -134,10 +173,18 @@ mem_init(void)
 {
 	uint32_t cr0;
 	size_t n;
+	uint32_t edx;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
 
+	// Map the kernel's big static regions with 4MB pages if we can.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_EDX_PSE) {
+		lcr4(rcr4() | CR4_PSE);
+		page_pse = true;
+	}
+
 	//////////////////////////////////////////////////////////////////////
 	// create initial page directory.
 	kern_pgdir = (pde_t *) boot_alloc(PGSIZE);
@@ -169,6 +216,12 @@ mem_init(void)
     envs = (struct Env *)boot_alloc(NENV * sizeof(struct Env));
     memset(envs, 0, NENV * sizeof(struct Env));
 
+	// Per-CPU latency statistics, also mapped for the user below.
+	static_assert(KSTAT_NCPU == NCPU);
+	static_assert(UKSTATS + NCPU * sizeof(struct Kstats) <= UENVS + PTSIZE);
+	kstats = (struct Kstats *) boot_alloc(NCPU * sizeof(struct Kstats));
+	memset(kstats, 0, NCPU * sizeof(struct Kstats));
+
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
 	// up the list of free physical pages. Once we've done so, all further
@@ -211,6 +264,13 @@ mem_init(void)
                    (void *)(UENVS + off), PTE_U);
     }
 
+	// Map the per-CPU kernel statistics read-only by the user at UKSTATS.
+	n = ROUNDUP(NCPU * sizeof(struct Kstats), PGSIZE);
+	for (size_t off = 0; off < n; off += PGSIZE) {
+		page_insert(kern_pgdir, pa2page(PADDR(kstats) + off),
+			    (void *)(UKSTATS + off), PTE_U);
+	}
+
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
 	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
@@ -235,9 +295,10 @@ mem_init(void)
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
-    for (size_t off = 0; off <= 0xfffff000 - KERNBASE; off += PGSIZE) {
-        page_insert(kern_pgdir, pa2page(off % (npages * PGSIZE)), 
-                   (void *)(KERNBASE + off), PTE_W);
+    boot_map_region(kern_pgdir, KERNBASE, -KERNBASE, 0, PTE_W);
+    if (page_pse) {
+        cprintf("mem_init: %d page tables saved by 4MB pages\n", 
+                page_pse_ptables);
     }
 
 	// Initialize the SMP-related parts of the memory map
@@ -268,6 +329,24 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	// From now on page_alloc and page_free go through the per-CPU
+	// caches and the buddy allocator.
+	buddy_init();
+	for (size_t i = 0; i < NCPU; i++)
+		__spin_initlock(&page_caches[i].pc_lock, "page_cache_lock",
+				LOCK_RANK_PAGECACHE);
+	page_caches_enabled = true;
+}
+
+// Per-CPU part of mem_init, for the APs: enable 4MB pages as the boot
+// CPU did, then switch to kern_pgdir.
+void
+mem_init_percpu(void)
+{
+	if (page_pse)
+		lcr4(rcr4() | CR4_PSE);
+	lcr3(PADDR(kern_pgdir));
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -360,6 +439,299 @@ page_init(void)
 	}
 }
 
+//
+// Buddy allocator.  Free memory is kept as blocks of 1 << order pages,
+// order 0 to BUDDY_MAX_ORDER, each aligned to its size.  Allocation
+// splits the smallest big-enough block; freeing merges a block with its
+// buddy (the other half of the next larger block) for as long as that
+// buddy is free as a whole.  The head page of a free block is marked
+// PP_FREE and records its order.  The caller holds page_lock.
+//
+
+static void
+buddy_insert(struct PageInfo *pp, int order)
+{
+    pp->pp_flags |= PP_FREE;
+    pp->pp_order = order;
+    pp->pp_prev = NULL;
+    pp->pp_link = buddy_free_area[order];
+    if (pp->pp_link != NULL) {
+        pp->pp_link->pp_prev = pp;
+    }
+    buddy_free_area[order] = pp;
+    buddy_nfree[order]++;
+}
+
+static void
+buddy_remove(struct PageInfo *pp, int order)
+{
+    if (pp->pp_prev != NULL) {
+        pp->pp_prev->pp_link = pp->pp_link;
+    } else {
+        buddy_free_area[order] = pp->pp_link;
+    }
+    if (pp->pp_link != NULL) {
+        pp->pp_link->pp_prev = pp->pp_prev;
+    }
+    pp->pp_flags &= ~PP_FREE;
+    pp->pp_link = pp->pp_prev = NULL;
+    buddy_nfree[order]--;
+}
+
+static struct PageInfo *
+buddy_alloc(int order)
+{
+    struct PageInfo *pp;
+    int o;
+    for (o = order; o <= BUDDY_MAX_ORDER && buddy_free_area[o] == NULL; o++) {
+        ;
+    }
+    if (o > BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+    pp = buddy_free_area[o];
+    buddy_remove(pp, o);
+    // Give back the upper halves we don't need.
+    while (o > order) {
+        o--;
+        buddy_insert(pp + (1 << o), o);
+    }
+    buddy_npages -= 1 << order;
+    return pp;
+}
+
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+    size_t pn = pp - pages;
+    buddy_npages += 1 << order;
+    for (; order < BUDDY_MAX_ORDER; order++) {
+        size_t bn = pn ^ (1 << order);
+        if (bn + (1 << order) > npages ||
+            !(pages[bn].pp_flags & PP_FREE) || pages[bn].pp_order != order) {
+            break;
+        }
+        buddy_remove(&pages[bn], order);
+        pn &= ~(1 << order);
+    }
+    buddy_insert(&pages[pn], order);
+}
+
+// Hand the free pages over from page_free_list at the end of mem_init.
+static void
+buddy_init(void)
+{
+    struct PageInfo *pp;
+    spin_lock(&page_lock);
+    while ((pp = page_free_list) != NULL) {
+        page_free_list = pp->pp_link;
+        pp->pp_link = NULL;
+        buddy_free(pp, 0);
+    }
+    spin_unlock(&page_lock);
+}
+
+//
+// Per-CPU page caches.  Each CPU frees into and allocates from its own
+// magazine, and only takes page_lock to move PCP_BATCH pages at a time
+// between the magazine and the buddy allocator.
+//
+
+// Move up to PCP_BATCH pages from the buddy allocator into pc.
+// The caller holds pc->pc_lock.
+static void
+page_cache_refill(struct PageCache *pc)
+{
+    struct PageInfo *pp;
+    int n;
+    spin_lock(&page_lock);
+    for (n = 0; n < PCP_BATCH && (pp = buddy_alloc(0)) != NULL; n++) {
+        pp->pp_link = pc->pc_list;
+        pc->pc_list = pp;
+    }
+    spin_unlock(&page_lock);
+    pc->pc_count += n;
+    pc->pc_refills++;
+}
+
+// Move up to n pages from pc back to the buddy allocator.
+// The caller holds pc->pc_lock.
+static void
+page_cache_drain(struct PageCache *pc, int n)
+{
+    struct PageInfo *pp;
+    spin_lock(&page_lock);
+    for (; n > 0 && (pp = pc->pc_list) != NULL; n--) {
+        pc->pc_list = pp->pp_link;
+        pp->pp_link = NULL;
+        buddy_free(pp, 0);
+        pc->pc_count--;
+    }
+    spin_unlock(&page_lock);
+    pc->pc_drains++;
+}
+
+// Return every CPU's cached pages to the buddy allocator.
+static void
+page_cache_reclaim(void)
+{
+    struct PageCache *pc;
+    for (pc = page_caches; pc < page_caches + NCPU; pc++) {
+        spin_lock(&pc->pc_lock);
+        if (pc->pc_count > 0) {
+            page_cache_drain(pc, pc->pc_count);
+        }
+        spin_unlock(&pc->pc_lock);
+    }
+}
+
+static struct PageInfo *
+page_zero_pop(void)
+{
+    struct PageInfo *pp;
+    spin_lock(&page_zero_lock);
+    if ((pp = page_zero_list) != NULL) {
+        page_zero_list = pp->pp_link;
+        page_zero_count--;
+    }
+    spin_unlock(&page_zero_lock);
+    return pp;
+}
+
+// Called by a CPU that is about to halt: zero up to ZERO_BATCH free pages
+// and add them to the pre-zeroed pool.  Stops early when memory is
+// short, so the pool doesn't soak up the last free pages.
+void
+page_zero_idle(void)
+{
+    struct PageInfo *pp;
+    if (!page_caches_enabled) {
+        return;
+    }
+    for (int n = 0; n < ZERO_BATCH && page_zero_count < ZERO_POOL_MAX; n++) {
+        if (buddy_npages == 0 || (pp = page_alloc(0)) == NULL) {
+            break;
+        }
+        memset(page2kva(pp), 0, PGSIZE);
+        spin_lock(&page_zero_lock);
+        pp->pp_link = page_zero_list;
+        page_zero_list = pp;
+        page_zero_count++;
+        spin_unlock(&page_zero_lock);
+        page_caches[cpunum()].pc_zeroed++;
+    }
+}
+
+// Give the pre-zeroed pool back to the buddy allocator.
+static void
+page_zero_reclaim(void)
+{
+    struct PageInfo *pp, *list;
+    spin_lock(&page_zero_lock);
+    list = page_zero_list;
+    page_zero_list = NULL;
+    page_zero_count = 0;
+    spin_unlock(&page_zero_lock);
+    spin_lock(&page_lock);
+    while ((pp = list) != NULL) {
+        list = pp->pp_link;
+        pp->pp_link = NULL;
+        buddy_free(pp, 0);
+    }
+    spin_unlock(&page_lock);
+}
+
+//
+// Allocates 1 << order physically contiguous pages, aligned to their
+// size, for 0 <= order <= BUDDY_MAX_ORDER.  Honors ALLOC_ZERO like
+// page_alloc and, like it, does not increment any reference count.
+// Free the block with page_free_npages and the same order.
+//
+// Only available once mem_init is done.  Pages parked in the per-CPU
+// caches and the zero pool keep their buddies from merging, so those
+// are given back before giving up.
+//
+// Returns NULL if out of memory or order is out of range.
+//
+struct PageInfo *
+page_alloc_npages(int order, int alloc_flags)
+{
+    struct PageInfo *pp;
+    if (!page_caches_enabled || order < 0 || order > BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+    spin_lock(&page_lock);
+    pp = buddy_alloc(order);
+    spin_unlock(&page_lock);
+    if (pp == NULL) {
+        page_cache_reclaim();
+        page_zero_reclaim();
+        spin_lock(&page_lock);
+        pp = buddy_alloc(order);
+        spin_unlock(&page_lock);
+    }
+    if (pp == NULL) {
+        return NULL;
+    }
+    pp->pp_ref = 0;
+    if (alloc_flags & ALLOC_ZERO) {
+        memset(page2kva(pp), 0, PGSIZE << order);
+    }
+    return pp;
+}
+
+//
+// Return a block from page_alloc_npages to the buddy allocator.
+//
+void
+page_free_npages(struct PageInfo *pp, int order)
+{
+    assert(order >= 0 && order <= BUDDY_MAX_ORDER);
+    assert((pp - pages) % (1 << order) == 0);
+    if (pp->pp_ref != 0) {
+        panic("page_free_npages: freeing an in-used block");
+    }
+    if (pp->pp_link != NULL || (pp->pp_flags & PP_FREE)) {
+        panic("page_free_npages: double free detected");
+    }
+    spin_lock(&page_lock);
+    buddy_free(pp, order);
+    spin_unlock(&page_lock);
+}
+
+//
+// Allocates a 4MB block of physically contiguous, PTSIZE-aligned pages
+// to back a 4MB (PTE_PS) mapping, and returns its first page, marked
+// PP_LARGE.  Like page_alloc, honors ALLOC_ZERO and does not increment
+// the reference count.
+//
+// Returns NULL if PSE is unavailable or no free 4MB block exists.
+//
+struct PageInfo *
+page_alloc_large(int alloc_flags)
+{
+    struct PageInfo *pp;
+    if (!page_pse) {
+        return NULL;
+    }
+    if ((pp = page_alloc_npages(PDXSHIFT - PTXSHIFT, alloc_flags)) != NULL) {
+        pp->pp_flags |= PP_LARGE;
+    }
+    return pp;
+}
+
+// Atomically add delta to pp->pp_ref and return the new count.
+// References to a page of a 4MB block are counted on its head.
+static inline uint16_t
+page_ref_add(struct PageInfo *pp, int16_t delta)
+{
+    uint16_t old = delta;
+    pp = page_head(pp);
+    asm volatile("lock; xaddw %0, %1"
+                 : "+r" (old), "+m" (pp->pp_ref) : : "memory", "cc");
+    return old + delta;
+}
+
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
 // returned physical page with '\0' bytes.  Does NOT increment the reference
@@ -376,9 +748,49 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-    struct PageInfo *pp;
-    if ((pp = page_free_list) != NULL) {
-        page_free_list = page_free_list->pp_link;
+    struct PageInfo *pp = NULL;
+    struct PageCache *pc;
+    if ((alloc_flags & ALLOC_ZERO) && page_caches_enabled) {
+        if ((pp = page_zero_pop()) != NULL) {
+            page_caches[cpunum()].pc_zero_hits++;
+            pp->pp_ref = 0;
+            pp->pp_link = NULL;
+            return pp;
+        }
+        page_caches[cpunum()].pc_zero_misses++;
+    }
+    if (page_caches_enabled) {
+        pc = &page_caches[cpunum()];
+        spin_lock(&pc->pc_lock);
+        if (pc->pc_list == NULL) {
+            page_cache_refill(pc);
+        }
+        if ((pp = pc->pc_list) != NULL) {
+            pc->pc_list = pp->pp_link;
+            pc->pc_count--;
+            pc->pc_allocs++;
+        }
+        spin_unlock(&pc->pc_lock);
+        // The global list ran dry, but other CPUs may still be
+        // caching free pages.
+        if (pp == NULL) {
+            page_cache_reclaim();
+        }
+    }
+    if (pp == NULL) {
+        spin_lock(&page_lock);
+        if (page_caches_enabled) {
+            pp = buddy_alloc(0);
+        } else if ((pp = page_free_list) != NULL) {
+            page_free_list = page_free_list->pp_link;
+        }
+        spin_unlock(&page_lock);
+    }
+    // Last resort: the pre-zeroed pool is free memory too.
+    if (pp == NULL) {
+        pp = page_zero_pop();
+    }
+    if (pp != NULL) {
         pp->pp_ref = 0;
         pp->pp_link = NULL;
         if (alloc_flags & ALLOC_ZERO) {
@@ -398,14 +810,46 @@ page_free(struct PageInfo *pp)
 	// Fill this function in
 	// Hint: You may want to panic if pp->pp_ref is nonzero or
 	// pp->pp_link is not NULL.
+    struct PageCache *pc;
     if (pp->pp_ref != 0) {
         panic("page_free: freeing an in-used page");
     }
-    if (pp->pp_link != NULL) {
+    if (pp->pp_link != NULL || (pp->pp_flags & PP_FREE)) {
         panic("page_free: double free detected");
     }
-    pp->pp_link = page_free_list;
-    page_free_list = pp;
+    if (pp->pp_flags & PP_LARGE) {
+        // A 4MB block goes straight back to the buddy allocator.
+        pp->pp_flags &= ~PP_LARGE;
+        page_free_npages(pp, PDXSHIFT - PTXSHIFT);
+        return;
+    }
+    if (!page_caches_enabled) {
+        spin_lock(&page_lock);
+        pp->pp_link = page_free_list;
+        page_free_list = pp;
+        spin_unlock(&page_lock);
+        return;
+    }
+    pc = &page_caches[cpunum()];
+    spin_lock(&pc->pc_lock);
+    pp->pp_link = pc->pc_list;
+    pc->pc_list = pp;
+    pc->pc_count++;
+    pc->pc_frees++;
+    if (pc->pc_count > PCP_HIGH) {
+        page_cache_drain(pc, PCP_BATCH);
+    }
+    spin_unlock(&pc->pc_lock);
+}
+
+//
+// Increment the reference count on a page, for references that do not
+// come from a mapping.
+//
+void
+page_incref(struct PageInfo *pp)
+{
+    page_ref_add(pp, 1);
 }
 
 //
@@ -415,7 +859,20 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	struct TlbBatch *tb;
+
+	pp = page_head(pp);
+	// A page shared between address spaces (COW, IPC) may be released
+	// by several CPUs at once, each holding only its own env's lock.
+	if (page_ref_add(pp, -1) != 0)
+		return;
+	// Another CPU may still reach the page through a stale TLB entry
+	// until tlb_shootdown_flush: don't let it be reused before then.
+	tb = &tlb_batch[cpunum()];
+	if (tb->tb_cpus) {
+		pp->pp_link = tb->tb_free;
+		tb->tb_free = pp;
+	} else
 		page_free(pp);
 }
 
@@ -445,6 +902,10 @@ page_decref(struct PageInfo* pp)
 // 1. pgdir_walk(pgdir, va, false) == NULL (no such a page table)
 // 2. *pgdir_walk(pgdir, va, false) == 0 (no such a page table entry)
 //
+// If va is covered by a 4MB page (PTE_PS), the page directory entry
+// itself is returned; pte_pa gives the 4KB frame it maps va to.  Such
+// entries are never replaced by a page table, even if create is set.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
@@ -470,6 +931,9 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
         pgdir[pdx] = page2pa(pp) | PTE_P | PTE_U | PTE_W;
         pp->pp_ref += 1;
     }
+    if (pgdir[pdx] & PTE_PS) {
+        return &pgdir[pdx];
+    }
     // PTE_ADDR(pte) mask the physical address of
     // a page directory entry (points to page table) or a page table entry.
     // Note that although we have set up a more reliable physical paging mechanism 
@@ -491,15 +955,27 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
+// With PSE on, each 4MB-aligned stretch of va and pa that has no page
+// table yet is mapped with a single 4MB page directory entry instead.
+//
 // Hint: the TA solution uses pgdir_walk
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
 	// Fill this function in
-    for (size_t off = 0; off < size; off += PGSIZE) {
-        pte_t *pte = pgdir_walk(pgdir, (void *)(va + off), 1);
-        assert(pte != NULL);
+    for (size_t off = 0; off < size; ) {
+        uintptr_t v = va + off;
+        if (page_pse && v % PTSIZE == 0 && (pa + off) % PTSIZE == 0 && 
+            size - off >= PTSIZE && !(pgdir[PDX(v)] & PTE_P)) {
+            pgdir[PDX(v)] = (pa + off) | perm | PTE_PS | PTE_P;
+            page_pse_ptables++;
+            off += PTSIZE;
+            continue;
+        }
+        pte_t *pte = pgdir_walk(pgdir, (void *)v, 1);
+        assert(pte != NULL && !(*pte & PTE_PS));
         *pte = (pa + off) | perm | PTE_P;
+        off += PGSIZE;
     }
 }
 
@@ -521,6 +997,11 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // frequently leads to subtle bugs; there's an elegant way to handle
 // everything in one code path.
 //
+// With PTE_PS in perm, pp must be a PP_LARGE page from page_alloc_large
+// and va PTSIZE-aligned: the whole 4MB slot is unmapped, including its
+// page table, and pp is mapped there as a 4MB page.  Inserting a 4KB
+// page into a slot mapped by a 4MB page unmaps the 4MB page first.
+//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
@@ -533,6 +1014,19 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
 	// Fill this function in
     pte_t *pte;
+    if (perm & PTE_PS) {
+        assert((pp->pp_flags & PP_LARGE) && (uintptr_t)va % PTSIZE == 0);
+        page_ref_add(pp, 1);
+        page_remove_pt(pgdir, va);
+        pgdir[PDX(va)] = page2pa(pp) | perm | PTE_P;
+        return 0;
+    }
+    if (pgdir[PDX(va)] & PTE_PS) {
+        // Keep pp alive in case it is part of the 4MB page.
+        page_ref_add(pp, 1);
+        page_remove(pgdir, va);
+        page_ref_add(pp, -1);
+    }
     if ((pte = pgdir_walk(pgdir, va, 1)) == NULL) {
         return -E_NO_MEM;
     }
@@ -543,7 +1037,7 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
     // then call page_remove to decrement victim->pp_ref.
     // If victim and pp point to the same page, pp_ref should not be zero after page_remove()
     // and thus that page won't be at the free list when it is inserted into the page table
-    pp->pp_ref += 1;
+    page_ref_add(pp, 1);
     page_remove(pgdir, va);
     *pte = page2pa(pp) | perm | PTE_P;
 	return 0;
@@ -574,13 +1068,15 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
     if (pte_store != NULL) {
         *pte_store = pte;
     }
-    return pa2page(PTE_ADDR(*pte));
+    return pa2page(pte_pa(*pte, va));
 }
 
 //
 // Unmaps the physical page at virtual address 'va'.
 // If there is no physical page at that address, silently does nothing.
 //
+// If va lies in a 4MB page, the whole 4MB page is unmapped.
+//
 // Details:
 //   - The ref count on the physical page should decrement.
 //   - The physical page should be freed if the refcount reaches 0.
@@ -601,21 +1097,125 @@ page_remove(pde_t *pgdir, void *va)
     if ((pp = page_lookup(pgdir, va, &pte)) == NULL) {
         return;
     }
-    tlb_invalidate(pgdir, va);
     *pte = 0;
+    tlb_invalidate(pgdir, va);
+    page_decref(pp);
+}
+
+//
+// Unmap everything in the 4MB slot of pgdir that contains va: either a
+// 4MB page, or every page of the slot's page table and then the page
+// table itself.
+//
+void
+page_remove_pt(pde_t *pgdir, void *va)
+{
+    pde_t *pde = &pgdir[PDX(va)];
+    pte_t *pt;
+    struct PageInfo *pp;
+    if (!(*pde & PTE_P)) {
+        return;
+    }
+    if (*pde & PTE_PS) {
+        page_remove(pgdir, va);
+        return;
+    }
+    pt = (pte_t *)KADDR(PTE_ADDR(*pde));
+    for (size_t ptx = 0; ptx < NPTENTRIES; ptx++) {
+        if (pt[ptx] & PTE_P) {
+            page_remove(pgdir, PGADDR(PDX(va), ptx, 0));
+        }
+    }
+    pp = pa2page(PTE_ADDR(*pde));
+    *pde = 0;
+    // Drop any cached copy of the page directory entry too.
+    tlb_invalidate(pgdir, va);
     page_decref(pp);
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// Inside tlb_batch_begin/tlb_batch_end, just note that a flush is due.
+// Call this after updating the PTE.
+//
+// Other CPUs that have the page tables loaded are sent the
+// invalidation later, by tlb_shootdown_flush, together with
+// everything else this system call changes.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	struct TlbBatch *tb = &tlb_batch[cpunum()];
+	uint32_t mask;
+
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
-		invlpg(va);
+	if (!curenv || curenv->env_pgdir == pgdir) {
+		if (tb->tb_active)
+			tb->tb_pending = true;
+		else
+			invlpg(va);
+	}
+
+	if ((mask = tlb_shootdown_cpus(pgdir)) != 0) {
+		tb->tb_cpus |= mask;
+		if (tb->tb_nva < TLB_SHOOTDOWN_MAX)
+			tb->tb_va[tb->tb_nva] = (uintptr_t)va;
+		if (tb->tb_nva <= TLB_SHOOTDOWN_MAX)
+			tb->tb_nva++;
+	}
+}
+
+// Defer this CPU's TLB invalidations until tlb_batch_end, which replaces
+// them with a single full flush.  For bulk page-table updates that would
+// otherwise issue one invlpg per page (see sys_page_batch).
+void
+tlb_batch_begin(void)
+{
+	tlb_batch[cpunum()].tb_active = true;
+}
+
+// Perform the flush deferred so far, staying in batch mode.  Needed
+// before the kernel touches user memory whose mappings the batch may
+// have changed.
+void
+tlb_batch_flush(void)
+{
+	struct TlbBatch *tb = &tlb_batch[cpunum()];
+
+	if (tb->tb_pending) {
+		lcr3(rcr3());
+		tb->tb_pending = false;
+	}
+}
+
+void
+tlb_batch_end(void)
+{
+	tlb_batch_flush();
+	tlb_batch[cpunum()].tb_active = false;
+}
+
+// Send the invalidations this CPU owes other CPUs, one IPI per CPU
+// however many pages changed, then free the pages they covered.
+// Called with no locks held, on the way out to user mode (env_run) or
+// into the idle loop (sched_halt); see tlb_shootdown.
+void
+tlb_shootdown_flush(void)
+{
+	struct TlbBatch *tb = &tlb_batch[cpunum()];
+	struct PageInfo *pp;
+
+	if (!tb->tb_cpus)
+		return;
+	tlb_shootdown(tb->tb_cpus, tb->tb_va, tb->tb_nva);
+	tb->tb_cpus = 0;
+	tb->tb_nva = 0;
+	while ((pp = tb->tb_free) != NULL) {
+		tb->tb_free = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
 }
 
 //
@@ -726,6 +1326,7 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n", env->env_id, user_mem_check_addr);
+		lock_kernel_if_needed();
 		env_destroy(env);	// may not return
 	}
 }
@@ -904,6 +1505,11 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
+	// check kernel statistics
+	n = ROUNDUP(NCPU*sizeof(struct Kstats), PGSIZE);
+	for (i = 0; i < n; i += PGSIZE)
+		assert(check_va2pa(pgdir, UKSTATS + i) == PADDR(kstats) + i);
+
 	// check phys mem
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE) 
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
@@ -954,6 +1560,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return pte_pa(*pgdir, (void *)va);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
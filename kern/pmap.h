@@ -8,6 +8,9 @@
 
 #include <inc/memlayout.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 struct Env;
 
 extern char bootstacktop[], bootstack[];
@@ -51,17 +54,59 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// Per-CPU cache of free pages (see page_alloc).
+#define PCP_HIGH	64	// Drain a cache that grows past this many pages
+#define PCP_BATCH	16	// Pages moved per refill or drain
+
+struct PageCache {
+	struct spinlock pc_lock;
+	struct PageInfo *pc_list;	// Free pages, linked by pp_link
+	int pc_count;			// Length of pc_list
+	// Statistics, shown by the monitor's "pagecache" command
+	uint32_t pc_allocs;
+	uint32_t pc_frees;
+	uint32_t pc_refills;
+	uint32_t pc_drains;
+	uint32_t pc_zero_hits;		// ALLOC_ZERO served from the zero pool
+	uint32_t pc_zero_misses;	// ALLOC_ZERO that had to memset
+	uint32_t pc_zeroed;		// Pages zeroed while idle
+};
+
+extern struct PageCache page_caches[NCPU];
+
+// Pre-zeroed page pool (see page_zero_idle).
+#define ZERO_POOL_MAX	256	// Pages kept zeroed ahead of time
+#define ZERO_BATCH	16	// Pages zeroed per trip through sched_halt
+
+extern int page_zero_count;
+
+// Buddy allocator (see page_alloc_npages).
+#define BUDDY_MAX_ORDER	10	// Largest block: 1 << 10 pages, a 4MB page
+
+extern size_t buddy_nfree[BUDDY_MAX_ORDER + 1];
+
 void	mem_init(void);
+void	mem_init_percpu(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
+struct PageInfo *page_alloc_large(int alloc_flags);
+struct PageInfo *page_alloc_npages(int order, int alloc_flags);
 void	page_free(struct PageInfo *pp);
+void	page_free_npages(struct PageInfo *pp, int order);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
+void	page_remove_pt(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
+void	page_incref(struct PageInfo *pp);
 void	page_decref(struct PageInfo *pp);
+void	page_zero_idle(void);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_batch_begin(void);
+void	tlb_batch_flush(void);
+void	tlb_batch_end(void);
+void	tlb_shootdown_flush(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
@@ -82,6 +127,15 @@ pa2page(physaddr_t pa)
 	return &pages[PGNUM(pa)];
 }
 
+// The page that holds the reference count for pp: the head of the 4MB
+// block pp belongs to, if any, or else pp itself.
+static inline struct PageInfo*
+page_head(struct PageInfo *pp)
+{
+	struct PageInfo *head = &pages[ROUNDDOWN(pp - pages, NPTENTRIES)];
+	return (head->pp_flags & PP_LARGE) ? head : pp;
+}
+
 // map PageInfo struct to the correpsonding page vitural address
 static inline void*
 page2kva(struct PageInfo *pp)
@@ -91,4 +145,25 @@ page2kva(struct PageInfo *pp)
 
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
+// The physical address of the 4KB page that va maps to through pte, an
+// entry returned by pgdir_walk: either a PTE or a 4MB (PTE_PS) PDE.
+static inline physaddr_t
+pte_pa(pte_t pte, const void *va)
+{
+	if (pte & PTE_PS)
+		return (pte & ~(PTSIZE - 1)) | (PTX(va) << PTXSHIFT);
+	return PTE_ADDR(pte);
+}
+
+// Switch this CPU to pgdir, noting it for tlb_shootdown_cpus.  The
+// counter is bumped after the load: other CPUs take it to mean that
+// this TLB holds nothing older.
+static inline void
+pgdir_load(pde_t *pgdir)
+{
+	thiscpu->cpu_pgdir = (pgdir == kern_pgdir) ? NULL : pgdir;
+	lcr3(PADDR(pgdir));
+	thiscpu->cpu_cr3_loads++;
+}
+
 #endif /* !JOS_KERN_PMAP_H */
@@ -5,6 +5,10 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/spinlock.h>
+
+// Keeps lines from different CPUs from interleaving.
+static struct spinlock cons_lock = SPINLOCK_INIT(cons_lock, LOCK_RANK_CONSOLE);
 
 static void
 putch(int ch, int *cnt)
@@ -16,9 +20,17 @@ putch(int ch, int *cnt)
 int
 vcprintf(const char *fmt, va_list ap)
 {
+	extern const char *panicstr;
 	int cnt = 0;
+	// Once panicking, print regardless: the lock may be held by the
+	// CPU that panicked.
+	bool locking = !panicstr;
 
+	if (locking)
+		spin_lock(&cons_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	if (locking)
+		spin_unlock(&cons_lock);
 	return cnt;
 }
 
@@ -2,60 +2,394 @@
 #include <inc/x86.h>
 #include <kern/spinlock.h>
 #include <kern/env.h>
+#include <kern/fpu.h>
+#include <kern/kstats.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/wait.h>
+#include <kern/time.h>
 
 void sched_halt(void);
 
+// Steal work only from a CPU with at least this many more environments
+// to run than this one (see rq_steal).
+#define SCHED_IMBALANCE 2
+
+// Per-CPU run queues.
+//
+// Every ENV_RUNNABLE environment sits on exactly one CPU's run queue,
+// so picking the next environment costs O(1) instead of a scan over
+// all NENV slots.  An environment is put on a queue whenever it
+// becomes runnable (see sched_enqueue) and taken off either when a
+// CPU picks it to run or when it stops being runnable (sched_remove).
+// An environment goes back on the queue of the CPU it last ran on,
+// where its cache lines and TLB entries may still be, unless its
+// env_cpumask forbids that CPU.  A CPU whose own queue is empty steals
+// work from the busiest queue, but only when that CPU has more work
+// than it can run soon (see rq_steal).
+//
+// Each queue holds two scheduling classes.  SCHED_RT environments,
+// the servers, run first come first served ahead of everybody else.
+// SCHED_FAIR environments share what is left in proportion to their
+// weights: each one's env_vruntime grows with the cycles it runs,
+// divided by its weight, and the one furthest behind runs next.
+struct RunList {
+    struct Env *rl_head;        // Next environment to run
+    struct Env *rl_tail;
+};
+
+struct RunQueue {
+    struct RunList rq_rt;       // SCHED_RT, in the order they came
+    struct RunList rq_fair;     // SCHED_FAIR, by env_vruntime
+    int rq_len;                 // Number of queued environments
+    uint64_t rq_min_vruntime;   // env_vruntime of the last one picked
+};
+
+static struct RunQueue runqueues[NCPU];
+
+static struct RunList *
+rq_list(struct RunQueue *rq, struct Env *e)
+{
+    return e->env_sched_class == SCHED_RT ? &rq->rq_rt : &rq->rq_fair;
+}
+
+// Put e's virtual runtime, last compared on 'from', on rq's scale.  It
+// keeps its lead over the environments it competed with, but none
+// banks credit while it is blocked.
+static void
+rq_place(struct RunQueue *rq, struct Env *e, struct RunQueue *from)
+{
+    uint64_t lead = 0;
+
+    if (e->env_vruntime > from->rq_min_vruntime) {
+        lead = e->env_vruntime - from->rq_min_vruntime;
+    }
+    e->env_vruntime = rq->rq_min_vruntime + lead;
+}
+
+static void
+rq_push(struct RunQueue *rq, struct Env *e, int cpu)
+{
+    struct RunList *rl = rq_list(rq, e);
+    struct Env *prev = rl->rl_tail;
+
+    // Keep rq_fair sorted.  Whoever just ran is usually furthest
+    // ahead, so the search from the tail is short.
+    if (e->env_sched_class != SCHED_RT) {
+        while (prev != NULL && prev->env_vruntime > e->env_vruntime) {
+            prev = prev->env_rq_prev;
+        }
+    }
+    e->env_rq_prev = prev;
+    e->env_rq_next = prev != NULL ? prev->env_rq_next : rl->rl_head;
+    if (e->env_rq_next != NULL) {
+        e->env_rq_next->env_rq_prev = e;
+    } else {
+        rl->rl_tail = e;
+    }
+    if (prev != NULL) {
+        prev->env_rq_next = e;
+    } else {
+        rl->rl_head = e;
+    }
+    rq->rq_len++;
+    e->env_rq_cpu = cpu;
+}
+
+static void
+rq_unlink(struct RunQueue *rq, struct Env *e)
+{
+    struct RunList *rl = rq_list(rq, e);
+
+    if (e->env_rq_prev != NULL) {
+        e->env_rq_prev->env_rq_next = e->env_rq_next;
+    } else {
+        rl->rl_head = e->env_rq_next;
+    }
+    if (e->env_rq_next != NULL) {
+        e->env_rq_next->env_rq_prev = e->env_rq_prev;
+    } else {
+        rl->rl_tail = e->env_rq_prev;
+    }
+    e->env_rq_next = e->env_rq_prev = NULL;
+    e->env_rq_cpu = -1;
+    rq->rq_len--;
+}
+
+// Whether e may run on CPU 'cpu'.
+bool
+sched_allowed(struct Env *e, int cpu)
+{
+    return (e->env_cpumask & (1 << cpu)) != 0;
+}
+
+// The CPU whose run queue e should go on.
+static int
+sched_pick_cpu(struct Env *e)
+{
+    if (e->env_runs > 0 && sched_allowed(e, e->env_cpunum)) {
+        return e->env_cpunum;
+    }
+    if (sched_allowed(e, cpunum())) {
+        return cpunum();
+    }
+    for (int i = 0; i < ncpu; i++) {
+        if (sched_allowed(e, i)) {
+            return i;
+        }
+    }
+    return cpunum();
+}
+
+// The environment that should run next on rq, or NULL.
+static struct Env *
+rq_first(struct RunQueue *rq)
+{
+    if (rq->rq_rt.rl_head != NULL) {
+        return rq->rq_rt.rl_head;
+    }
+    return rq->rq_fair.rl_head;
+}
+
+// The number of environments CPU 'cpu' has to run: those on its queue
+// and the one it is running, if any.
+static int
+rq_load(int cpu)
+{
+    struct Env *running = cpus[cpu].cpu_env;
+
+    return runqueues[cpu].rq_len +
+           (running != NULL && running->env_status == ENV_RUNNING);
+}
+
+// Put a runnable environment on a run queue, preferably that of the
+// CPU it last ran on.  Does nothing if e is already queued.
+//
+// Halted CPUs take no timer interrupts, so wake the CPU with a
+// reschedule IPI if it is halted.  If it is busy enough that another
+// CPU would steal from it, wake a halted CPU e may run on to do so.
+void
+sched_enqueue(struct Env *e)
+{
+    int cpu;
+
+    assert(e->env_status == ENV_RUNNABLE);
+    if (e->env_rq_cpu >= 0) {
+        return;
+    }
+    cpu = sched_pick_cpu(e);
+    rq_place(&runqueues[cpu], e, &runqueues[e->env_cpunum]);
+    rq_push(&runqueues[cpu], e, cpu);
+
+    if (cpus[cpu].cpu_status != CPU_HALTED) {
+        if (rq_load(cpu) < SCHED_IMBALANCE) {
+            return;
+        }
+        for (cpu = 0; cpu < ncpu; cpu++) {
+            if (cpus[cpu].cpu_status == CPU_HALTED && sched_allowed(e, cpu)) {
+                break;
+            }
+        }
+        if (cpu == ncpu) {
+            return;
+        }
+    }
+    if (cpu != cpunum()) {
+        lapic_ipi_cpu(cpus[cpu].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+    }
+}
+
+// Take e off whichever run queue it is on, if any.
+// Must be called whenever a queued environment stops being runnable.
+void
+sched_remove(struct Env *e)
+{
+    if (e->env_rq_cpu < 0) {
+        return;
+    }
+    rq_unlink(&runqueues[e->env_rq_cpu], e);
+}
+
+// Change e's scheduling class and weight.
+void
+sched_set_class(struct Env *e, int class, uint32_t weight)
+{
+    int cpu = e->env_rq_cpu;
+
+    if (cpu >= 0) {
+        rq_unlink(&runqueues[cpu], e);
+    }
+    e->env_sched_class = class;
+    e->env_sched_weight = weight;
+    if (cpu >= 0) {
+        rq_push(&runqueues[cpu], e, cpu);
+    }
+}
+
+// Charge e, which has been running on this CPU, for the cycles since
+// it got the CPU or was last charged.
+void
+sched_account(struct Env *e)
+{
+    uint64_t now = read_tsc();
+    uint64_t cycles = now - e->env_run_start;
+
+    e->env_run_start = now;
+    e->env_runtime += cycles;
+    e->env_vruntime += cycles * SCHED_WEIGHT_DEFAULT / e->env_sched_weight;
+}
+
+// Take e off victim's queue and put it on this CPU's.
+static void
+rq_migrate(struct RunQueue *victim, struct Env *e)
+{
+    struct RunQueue *rq = &runqueues[cpunum()];
+
+    rq_unlink(victim, e);
+    rq_place(rq, e, victim);
+    rq_push(rq, e, cpunum());
+}
+
+// Even out the load between this CPU, whose queue is empty, and the
+// busiest other CPU.  Moving an environment costs it its warm caches,
+// so leave it where it is unless the other CPU has at least
+// SCHED_IMBALANCE more to run than we do: an environment just woken
+// onto an idle CPU will be running there shortly.
+// Returns the number of environments stolen.
+static int
+rq_steal(void)
+{
+    int me = cpunum();
+    int victim = -1;
+    int n = 0, want;
+
+    for (int i = 0; i < ncpu; i++) {
+        if (i == me || runqueues[i].rq_len == 0) {
+            continue;
+        }
+        if (victim < 0 || rq_load(i) > rq_load(victim)) {
+            victim = i;
+        }
+    }
+    if (victim < 0 || rq_load(victim) - rq_load(me) < SCHED_IMBALANCE) {
+        return 0;
+    }
+
+    // Steal the environments that would have run first there, skipping
+    // those that may not run here.
+    want = (rq_load(victim) - rq_load(me)) / 2;
+    for (struct Env *e = rq_first(&runqueues[victim]), *next;
+         e != NULL && n < want; e = next) {
+        next = e->env_rq_next;
+        if (next == NULL && e->env_sched_class == SCHED_RT) {
+            next = runqueues[victim].rq_fair.rl_head;
+        }
+        if (sched_allowed(e, me)) {
+            rq_migrate(&runqueues[victim], e);
+            n++;
+        }
+    }
+    return n;
+}
+
+// Change the set of CPUs e may run on.  If it is queued on a CPU it
+// may no longer use, move it; if it is running on one, it moves the
+// next time that CPU reschedules.
+void
+sched_set_affinity(struct Env *e, uint32_t cpumask)
+{
+    e->env_cpumask = cpumask;
+    if (e->env_rq_cpu >= 0 && !sched_allowed(e, e->env_rq_cpu)) {
+        sched_remove(e);
+        sched_enqueue(e);
+    }
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
-
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment. Make sure curenv is not null before
-	// dereferencing it.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-    size_t next = 0;
-    if (thiscpu->cpu_env != NULL) {
-        envid_t this_envid = thiscpu->cpu_env->env_id;
-        next = (ENVX(this_envid) + 1) % NENV;
-    }
-
-    for (size_t count = 0; count < NENV; count++) {
-        size_t idx = (count + next) % NENV;
-        if (envs[idx].env_status == ENV_RUNNABLE) {
-            idle = &envs[idx];
-            // env_run does not return
-            env_run(idle);
+    struct RunQueue *rq = &runqueues[cpunum()];
+    struct Env *next;
+
+    // Run the first queued environment: a SCHED_RT one if there is
+    // any, or else the SCHED_FAIR one with the least virtual runtime.
+    // env_run() puts the environment we are switching away from back
+    // on this queue.
+    //
+    // If our queue is empty, steal work from another CPU.  If there is
+    // nothing to steal either, but the environment previously running
+    // on this CPU is still ENV_RUNNING, keep running it.  Otherwise,
+    // drop through to sched_halt().
+    if (rq->rq_len == 0) {
+        rq_steal();
+    }
+    if ((next = rq_first(rq)) != NULL) {
+        rq_unlink(rq, next);
+        assert(next->env_status == ENV_RUNNABLE);
+        if (next->env_sched_class != SCHED_RT) {
+            rq->rq_min_vruntime = MAX(rq->rq_min_vruntime, next->env_vruntime);
         }
+        // env_run does not return
+        env_run(next);
     }
 
-    if (thiscpu->cpu_env != NULL && 
+    if (thiscpu->cpu_env != NULL &&
         thiscpu->cpu_env->env_status == ENV_RUNNING) {
-        env_run(thiscpu->cpu_env);
+        if (sched_allowed(thiscpu->cpu_env, cpunum())) {
+            env_run(thiscpu->cpu_env);
+        }
+        // It may no longer run here: hand it to a CPU it may run on.
+        thiscpu->cpu_env->env_status = ENV_RUNNABLE;
+        sched_enqueue(thiscpu->cpu_env);
     }
 
 	// sched_halt never returns
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// Called on each timer tick.  Take the CPU from curenv only if a
+// queued environment should run before it: a SCHED_RT environment
+// gives way to other SCHED_RT ones, a SCHED_FAIR one to any SCHED_RT
+// one or to one that has fallen behind it.
+void
+sched_tick(void)
+{
+    struct RunQueue *rq = &runqueues[cpunum()];
+    struct Env *e = curenv;
+
+    if (e != NULL && e->env_status == ENV_RUNNING) {
+        sched_account(e);
+        if (sched_allowed(e, cpunum()) && rq->rq_rt.rl_head == NULL &&
+            (e->env_sched_class == SCHED_RT ||
+             rq->rq_fair.rl_head == NULL ||
+             rq->rq_fair.rl_head->env_vruntime >= e->env_vruntime)) {
+            env_run(e);
+        }
+    }
+    sched_yield();
+}
+
+// Set this CPU's timer for going idle.
+static void
+sched_idle_timer(void)
+{
+    unsigned int deadline = wait_next_deadline();
+
+    for (int i = 0; i < ncpu; i++) {
+        if (cpus[i].cpu_status != CPU_HALTED) {
+            deadline = 0;
+        }
+    }
+    if (deadline == 0) {
+        lapic_timer_stop();
+    } else {
+        lapic_timer_oneshot(MAX((int32_t)(deadline - time_msec()), 1));
+    }
+}
+
+// Halt this CPU when there is nothing to do. Wait until a reschedule
+// IPI or the timer wakes it up. This function never returns.
 //
 void
 sched_halt(void)
@@ -63,31 +397,48 @@ sched_halt(void)
 	int i;
 
 	// For debugging and testing purposes, if there are no runnable
-	// environments in the system, then drop into the kernel monitor.
+	// environments in the system, and no sleeping environment is
+	// going to time out, then drop into the kernel monitor.
 	for (i = 0; i < NENV; i++) {
 		if ((envs[i].env_status == ENV_RUNNABLE ||
 		     envs[i].env_status == ENV_RUNNING ||
 		     envs[i].env_status == ENV_DYING))
 			break;
 	}
-	if (i == NENV) {
+	if (i == NENV && !wait_has_deadlines()) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
 	// Mark that no environment is running on this CPU
+	kstat_stop();
+	if (curenv != NULL) {
+		sched_account(curenv);
+	}
+	fpu_save();
 	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	pgdir_load(kern_pgdir);
 
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
 	// big kernel lock
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
+	// Stop the scheduler tick: sched_enqueue wakes us with an IPI when
+	// there is work.  Sleepers still have to time out, so the last CPU
+	// to go idle keeps the timer, set for the earliest deadline.
+	sched_idle_timer();
+
 	// Release the big kernel lock as if we were "leaving" the kernel
 	unlock_kernel();
 
+	// Send any TLB invalidations left over from the last system call.
+	tlb_shootdown_flush();
+
+	// Use the idle time to zero some free pages for ALLOC_ZERO.
+	page_zero_idle();
+
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
 		"movl $0, %%ebp\n"
@@ -6,7 +6,20 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_tick(void) __attribute__((noreturn));
+
+void sched_enqueue(struct Env *e);
+void sched_remove(struct Env *e);
+void sched_set_class(struct Env *e, int class, uint32_t weight);
+void sched_set_affinity(struct Env *e, uint32_t cpumask);
+bool sched_allowed(struct Env *e, int cpu);
+void sched_account(struct Env *e);
+
 #endif	// !JOS_KERN_SCHED_H
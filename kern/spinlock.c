@@ -10,11 +10,7 @@
 #include <kern/kdebug.h>
 
 // The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
+struct spinlock kernel_lock = SPINLOCK_INIT(kernel_lock, LOCK_RANK_KERNEL);
 
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
@@ -35,21 +31,86 @@ get_caller_pcs(uint32_t pcs[])
 		pcs[i] = 0;
 }
 
+// Locks held by each CPU, in acquisition order, for the lock-order
+// checker.
+#define NHELD 8
+static struct spinlock *held[NCPU][NHELD];
+static int nheld[NCPU];
+
+// Panic unless acquiring lk respects the lock ranks (see LOCK_RANK_*).
+static void
+check_lock_order(struct spinlock *lk)
+{
+	int i, cpu = cpunum();
+	struct spinlock *h;
+
+	if (lk->rank == LOCK_RANK_NONE)
+		return;
+	for (i = 0; i < nheld[cpu]; i++) {
+		h = held[cpu][i];
+		if (h->rank > lk->rank || (h->rank == lk->rank && h >= lk))
+			panic("CPU %d cannot acquire %s (rank %d): "
+			      "holding %s (rank %d)", cpu, lk->name,
+			      lk->rank, h->name, h->rank);
+	}
+}
+
+static void
+push_held(struct spinlock *lk)
+{
+	int cpu = cpunum();
+
+	if (nheld[cpu] == NHELD)
+		panic("CPU %d cannot acquire %s: too many locks held",
+		      cpu, lk->name);
+	held[cpu][nheld[cpu]++] = lk;
+}
+
+static void
+pop_held(struct spinlock *lk)
+{
+	int i, cpu = cpunum();
+
+	for (i = nheld[cpu] - 1; i >= 0; i--)
+		if (held[cpu][i] == lk)
+			break;
+	if (i < 0)
+		return;
+	for (; i < nheld[cpu] - 1; i++)
+		held[cpu][i] = held[cpu][i + 1];
+	nheld[cpu]--;
+}
+#endif
+
 // Check whether this CPU is holding the lock.
-static int
-holding(struct spinlock *lock)
+bool
+spin_holding(struct spinlock *lk)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lk->locked && lk->cpu == thiscpu;
 }
+
+// Panic if this CPU still holds any lock, e.g. on the way back to
+// user mode.
+void
+spin_assert_none_held(void)
+{
+#ifdef DEBUG_SPINLOCK
+	int cpu = cpunum();
+
+	if (nheld[cpu] > 0)
+		panic("CPU %d returning to user mode holding %s",
+		      cpu, held[cpu][nheld[cpu] - 1]->name);
 #endif
+}
 
 void
-__spin_initlock(struct spinlock *lk, char *name)
+__spin_initlock(struct spinlock *lk, char *name, int rank)
 {
 	lk->locked = 0;
+	lk->cpu = 0;
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
-	lk->cpu = 0;
+	lk->rank = rank;
 #endif
 }
 
@@ -61,8 +122,9 @@ void
 spin_lock(struct spinlock *lk)
 {
 #ifdef DEBUG_SPINLOCK
-	if (holding(lk))
+	if (spin_holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+	check_lock_order(lk);
 #endif
 
 	// The xchg is atomic.
@@ -71,10 +133,12 @@ spin_lock(struct spinlock *lk)
 	while (xchg(&lk->locked, 1) != 0)
 		asm volatile ("pause");
 
+	lk->cpu = thiscpu;
+
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
-	lk->cpu = thiscpu;
 	get_caller_pcs(lk->pcs);
+	push_held(lk);
 #endif
 }
 
@@ -83,7 +147,7 @@ void
 spin_unlock(struct spinlock *lk)
 {
 #ifdef DEBUG_SPINLOCK
-	if (!holding(lk)) {
+	if (!spin_holding(lk)) {
 		int i;
 		uint32_t pcs[10];
 		// Nab the acquiring EIP chain before it gets released
@@ -104,8 +168,9 @@ spin_unlock(struct spinlock *lk)
 	}
 
 	lk->pcs[0] = 0;
-	lk->cpu = 0;
+	pop_held(lk);
 #endif
+	lk->cpu = 0;
 
 	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
 	// respect to any other instruction which references the same memory.
@@ -6,25 +6,60 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
+// Lock ranks, checked under DEBUG_SPINLOCK.  A CPU may only acquire a
+// lock whose rank is higher than that of every lock it already holds;
+// locks of the same rank (e.g. two environments' address-space locks)
+// must be acquired in increasing address order.  Rank 0 is unchecked.
+enum {
+	LOCK_RANK_NONE = 0,
+	LOCK_RANK_KERNEL,	// kernel_lock: scheduler, wait channels,
+				// env lifecycle, monitor and devices
+	LOCK_RANK_IPC,		// per-env IPC state (env_lock_ipc)
+	LOCK_RANK_ENVTABLE,	// env_free_list
+	LOCK_RANK_VM,		// per-env address space (env_lock_vm)
+	LOCK_RANK_KMEMCPU,	// per-CPU slab magazines (struct KmemCpu)
+	LOCK_RANK_KMEM,		// slab caches (struct KmemCache)
+	LOCK_RANK_PAGECACHE,	// per-CPU page caches (struct PageCache)
+	LOCK_RANK_PAGE,		// page_free_list
+	LOCK_RANK_SHOOTDOWN,	// per-CPU TLB shootdown requests (lapic.c)
+	LOCK_RANK_CONSOLE,	// cprintf
+};
+
 // Mutual exclusion lock.
 struct spinlock {
 	unsigned locked;       // Is the lock held?
+	struct CpuInfo *cpu;   // The CPU holding the lock.
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
 	char *name;            // Name of lock.
-	struct CpuInfo *cpu;   // The CPU holding the lock.
+	int rank;              // Lock-ordering rank (LOCK_RANK_*).
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
 };
 
-void __spin_initlock(struct spinlock *lk, char *name);
+void __spin_initlock(struct spinlock *lk, char *name, int rank);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+bool spin_holding(struct spinlock *lk);
+void spin_assert_none_held(void);
 
-#define spin_initlock(lock)   __spin_initlock(lock, #lock)
+#define spin_initlock(lock)   __spin_initlock(lock, #lock, LOCK_RANK_NONE)
+#define spin_initlock_rank(lock, rank)   __spin_initlock(lock, #lock, rank)
 
+// Static initializer for a lock with the given rank.
+#ifdef DEBUG_SPINLOCK
+#define SPINLOCK_INIT(lock, r)	{ .name = #lock, .rank = (r) }
+#else
+#define SPINLOCK_INIT(lock, r)	{ 0 }
+#endif
+
+// The big kernel lock.  It no longer covers all kernel work: the page
+// allocator, address spaces, IPC state and the env free list have their
+// own locks, and the system calls and faults that only need those run
+// without it (see syscall_needs_kernel_lock).  It still protects the
+// scheduler and environment lifecycle.
 extern struct spinlock kernel_lock;
 
 static inline void
@@ -45,4 +80,13 @@ unlock_kernel(void)
 	asm volatile("pause");
 }
 
+// For paths that may run with or without the big kernel lock (see
+// trap()): take it before touching scheduler state.
+static inline void
+lock_kernel_if_needed(void)
+{
+	if (!spin_holding(&kernel_lock))
+		lock_kernel();
+}
+
 #endif
@@ -7,11 +7,16 @@
 
 #include <kern/env.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/trap.h>
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/wait.h>
+#include <kern/kstats.h>
+#include <kern/fpu.h>
+#include <kern/spinlock.h>
 
 #include <kern/e1000.h>
 
@@ -89,12 +94,113 @@ sys_exofork(void)
         return err;
     }
     e->env_status = ENV_NOT_RUNNABLE;
+    if ((err = fpu_fork(e))) {
+        env_free(e);
+        return err;
+    }
+    e->env_sched_class = curenv->env_sched_class;
+    e->env_sched_weight = curenv->env_sched_weight;
+    e->env_cpumask = curenv->env_cpumask;
     memcpy(&e->env_tf, &curenv->env_tf, sizeof(struct Trapframe));
     // child env "return" 0
     e->env_tf.tf_regs.reg_eax = 0;
     return e->env_id;
 }
 
+// Share curenv's page at va with 'child' the way lib/fork.c's duppage
+// did: writable and copy-on-write pages become copy-on-write in both
+// environments, PTE_SHARE and read-only pages are mapped as they are.
+// pte may also be the page directory entry of a 4MB page at va.
+// Both address spaces are locked by the caller.
+static int
+fork_duppage(struct Env *child, void *va, pte_t *pte)
+{
+    int perm = *pte & (PTE_SYSCALL | PTE_PS);
+    if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW))) {
+        perm = (perm & ~PTE_W) | PTE_COW;
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+        tlb_invalidate(curenv->env_pgdir, va);
+    }
+    return page_insert(child->env_pgdir, pa2page(PTE_ADDR(*pte)), va, perm);
+}
+
+// Fork the current environment with copy-on-write, in one system call.
+// This does everything lib/fork.c used to do with sys_exofork and one or
+// two sys_page_map calls per page: the child gets a copy-on-write view of
+// every page below UTOP except the user exception stack, for which it
+// gets a fresh page, inherits the page fault upcall, and is marked
+// runnable.  The caller must have a page fault upcall that handles
+// PTE_COW faults (see lib/fork.c).
+//
+// Returns envid of new environment to the parent and 0 to the child,
+// or < 0 on error.  Errors are:
+//	-E_INVAL if the caller has no page fault upcall.
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+    int err;
+    struct Env *e;
+    struct PageInfo *pp;
+    if (curenv->env_pgfault_upcall == NULL) {
+        return -E_INVAL;
+    }
+    if ((err = sys_exofork()) < 0) {
+        return err;
+    }
+    e = &envs[ENVX(err)];
+    e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+
+    if ((pp = page_alloc(ALLOC_ZERO)) == NULL) {
+        err = -E_NO_MEM;
+        goto fail;
+    }
+    if ((err = page_insert(e->env_pgdir, pp, (void *)(UXSTACKTOP - PGSIZE),
+                           PTE_U | PTE_P | PTE_W))) {
+        page_free(pp);
+        goto fail;
+    }
+
+    if ((err = env_lock_vm2(curenv, 0, e, e->env_id))) {
+        goto fail;
+    }
+    // Our own writable mappings become read-only: flush once at the end.
+    tlb_batch_begin();
+    for (size_t pdx = 0; pdx < PDX(UTOP) && !err; pdx++) {
+        if (!(curenv->env_pgdir[pdx] & PTE_P)) {
+            continue;
+        }
+        // 4MB pages are shared copy-on-write as a whole; the kernel
+        // copies them on a write fault (see page_fault_handler).
+        if (curenv->env_pgdir[pdx] & PTE_PS) {
+            err = fork_duppage(e, PGADDR(pdx, 0, 0), &curenv->env_pgdir[pdx]);
+            continue;
+        }
+        pte_t *pt = (pte_t *)KADDR(PTE_ADDR(curenv->env_pgdir[pdx]));
+        for (size_t ptx = 0; ptx < NPTENTRIES && !err; ptx++) {
+            void *va = PGADDR(pdx, ptx, 0);
+            if (!(pt[ptx] & PTE_P) || va == (void *)(UXSTACKTOP - PGSIZE)) {
+                continue;
+            }
+            err = fork_duppage(e, va, &pt[ptx]);
+        }
+    }
+    tlb_batch_end();
+    env_unlock_vm2(curenv, e);
+    if (err) {
+        goto fail;
+    }
+
+    e->env_status = ENV_RUNNABLE;
+    sched_enqueue(e);
+    return e->env_id;
+
+fail:
+    env_free(e);
+    return err;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -120,7 +226,80 @@ sys_env_set_status(envid_t envid, int status)
     if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE) {
         return -E_INVAL;
     }
+    // A running env is already as runnable as it gets; marking it
+    // ENV_RUNNABLE would let another CPU pick it up at the same time.
+    if (e->env_status == ENV_RUNNING && status == ENV_RUNNABLE) {
+        return 0;
+    }
     e->env_status = status;
+    if (status == ENV_RUNNABLE) {
+        // forcibly woken: it no longer sleeps on a wait channel
+        wait_remove(e);
+        sched_enqueue(e);
+    } else {
+        sched_remove(e);
+    }
+    return 0;
+}
+
+// Put envid in scheduling class 'class' (SCHED_FAIR or SCHED_RT), with
+// 'weight' as its share of the CPU under SCHED_FAIR.  A SCHED_FAIR
+// environment with twice the weight of another gets twice the CPU time.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if class is not a valid class, if weight is not between
+//		1 and SCHED_WEIGHT_MAX, or if class is SCHED_RT and the
+//		caller is not SCHED_RT itself.
+static int
+sys_env_set_sched(envid_t envid, int class, uint32_t weight)
+{
+    int err;
+    struct Env *e;
+    if ((err = envid2env(envid, &e, 1))) {
+        return err;
+    }
+    if (class != SCHED_FAIR && class != SCHED_RT) {
+        return -E_INVAL;
+    }
+    if (weight == 0 || weight > SCHED_WEIGHT_MAX) {
+        return -E_INVAL;
+    }
+    // A SCHED_RT environment can starve everybody else, so only the
+    // servers may hand it out.
+    if (class == SCHED_RT && curenv->env_sched_class != SCHED_RT) {
+        return -E_INVAL;
+    }
+    sched_set_class(e, class, weight);
+    return 0;
+}
+
+// Let envid run only on the CPUs in cpumask, where bit n stands for
+// CPU n.  The environment keeps running where it last ran when it can,
+// so most environments are better off with the default CPUMASK_ALL.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpumask contains none of the CPUs in the system.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+    int err;
+    struct Env *e;
+    if ((err = envid2env(envid, &e, 1))) {
+        return err;
+    }
+    if ((cpumask & ((1 << ncpu) - 1)) == 0) {
+        return -E_INVAL;
+    }
+    sched_set_affinity(e, cpumask);
+    // Move off this CPU right away if we may no longer run here.
+    if (e == curenv && (cpumask & (1 << cpunum())) == 0) {
+        curenv->env_tf.tf_regs.reg_eax = 0;
+        sched_yield();
+    }
     return 0;
 }
 
@@ -144,6 +323,7 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
     }
     user_mem_assert(curenv, tf, sizeof(struct Trapframe), 0);
     e->env_tf = *tf;
+    e->env_sysexit = false;
     // the least significant 2 bits of cs specifies the CPL level.
 	e->env_tf.tf_cs |= 3;
     e->env_tf.tf_eflags |= FL_IF;
@@ -182,11 +362,17 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
 //
+// With PTE_PS in perm, allocate a physically contiguous 4MB page instead
+// and map it at 'va', which must be 4MB-aligned.  Everything mapped in
+// [va, va+PTSIZE) is unmapped as a side effect.  Unmapping any part of
+// a 4MB page later unmaps all of it.
+//
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
 //	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL if (perm & PTE_PS) and va is not 4MB-aligned.
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
@@ -208,14 +394,29 @@ sys_page_alloc(envid_t envid, void *va, int perm)
     if (va >= (void *)UTOP || ((uintptr_t)va & 0xfff)) {
         return -E_INVAL;
     }
-    if (!(perm & PTE_P) || !(perm & PTE_U) || (perm & ~PTE_SYSCALL)) {
+    if (!(perm & PTE_P) || !(perm & PTE_U) || (perm & ~(PTE_SYSCALL | PTE_PS))) {
+        return -E_INVAL;
+    }
+    if ((perm & PTE_PS) && ((uintptr_t)va & (PTSIZE - 1))) {
         return -E_INVAL;
     }
     struct PageInfo *pp;
-    if ((pp = page_alloc(ALLOC_ZERO)) == NULL) {
+    if (perm & PTE_PS) {
+        pp = page_alloc_large(ALLOC_ZERO);
+    } else {
+        pp = page_alloc(ALLOC_ZERO);
+    }
+    if (pp == NULL) {
         return -E_NO_MEM;
     }
-    if ((err = page_insert(e->env_pgdir, pp, va, perm))) {
+    if ((err = env_lock_vm(e, envid))) {
+        page_free(pp);
+        return err;
+    }
+    err = page_insert(e->env_pgdir, pp, va, perm);
+    env_unlock_vm(e);
+    if (err) {
+        page_free(pp);
         return err;
     }
     return 0;
@@ -227,6 +428,10 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 // that it also must not grant write access to a read-only
 // page.
 //
+// With PTE_PS in perm, share the whole 4MB page at srcva; both addresses
+// must then be 4MB-aligned.  Without it, a 4KB piece of a 4MB page can
+// be mapped like any other page.
+//
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
 //		or the caller doesn't have permission to change one of them.
@@ -234,6 +439,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //		or dstva >= UTOP or dstva is not page-aligned.
 //	-E_INVAL is srcva is not mapped in srcenvid's address space.
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if (perm & PTE_PS), but srcva is not the start of a 4MB
+//		page or dstva is not 4MB-aligned.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
@@ -264,21 +471,29 @@ sys_page_map(envid_t srcenvid, void *srcva,
     if (dstva >= (void *)UTOP || ((uintptr_t)dstva & 0xfff)) {
         return -E_INVAL;
     }
-    if (!(perm & PTE_P) || !(perm & PTE_U) || (perm & ~PTE_SYSCALL)) {
-        return -E_INVAL;
-    }
-    pte_t *pte;
-    struct PageInfo *pp;
-    if ((pp = page_lookup(srcenv->env_pgdir, srcva, &pte)) == NULL) {
+    if (!(perm & PTE_P) || !(perm & PTE_U) || (perm & ~(PTE_SYSCALL | PTE_PS))) {
         return -E_INVAL;
     }
-    if (!(*pte & PTE_W) && (perm & PTE_W)) {
+    if ((perm & PTE_PS) && 
+        (((uintptr_t)srcva | (uintptr_t)dstva) & (PTSIZE - 1))) {
         return -E_INVAL;
     }
-    if ((err = page_insert(dstenv->env_pgdir, pp, dstva, perm))) {
+    pte_t *pte;
+    struct PageInfo *pp;
+    if ((err = env_lock_vm2(srcenv, srcenvid, dstenv, dstenvid))) {
         return err;
     }
-    return 0;
+    if ((pp = page_lookup(srcenv->env_pgdir, srcva, &pte)) == NULL) {
+        err = -E_INVAL;
+    } else if (!(*pte & PTE_W) && (perm & PTE_W)) {
+        err = -E_INVAL;
+    } else if ((perm & PTE_PS) && !(*pte & PTE_PS)) {
+        err = -E_INVAL;
+    } else {
+        err = page_insert(dstenv->env_pgdir, pp, dstva, perm);
+    }
+    env_unlock_vm2(srcenv, dstenv);
+    return err;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -302,16 +517,304 @@ sys_page_unmap(envid_t envid, void *va)
     if (va >= (void *)UTOP || ((uintptr_t)va & 0xfff)) {
         return -E_INVAL;
     }
+    if ((err = env_lock_vm(e, envid))) {
+        return err;
+    }
     page_remove(e->env_pgdir, va);
+    env_unlock_vm(e);
+    return 0;
+}
+
+// Whether the IPC page range r (see IPC_RANGE) lies below UTOP, or
+// entirely above it, naming no pages.
+static bool
+ipc_range_ok(void *r)
+{
+    uintptr_t va = (uintptr_t)IPC_RANGE_VA(r);
+    return va >= UTOP || va + IPC_RANGE_NPAGES(r) * PGSIZE <= UTOP;
+}
+
+// Check a page to be sent from srcva with perm, as sys_ipc_try_send does,
+// and return it.  The caller holds curenv's address-space lock.
+static int
+ipc_lookup_page(void *srcva, unsigned perm, struct PageInfo **pp_store)
+{
+    pte_t *pte;
+    struct PageInfo *pp;
+    if (!(perm & PTE_P) || !(perm & PTE_U) || (perm & ~PTE_SYSCALL)) {
+        return -E_INVAL;
+    }
+    if ((pp = page_lookup(curenv->env_pgdir, srcva, &pte)) == NULL) {
+        return -E_INVAL;
+    }
+    if (!(*pte & PTE_W) && (perm & PTE_W)) {
+        return -E_INVAL;
+    }
+    *pp_store = pp;
     return 0;
 }
 
+// Map the pages of the range srcva into e at the range dstva, which
+// must be at least as large.  The caller holds both address-space
+// locks.  On error, none of the pages stays mapped.
+static int
+ipc_map_range(struct Env *e, void *srcva, unsigned perm, void *dstva)
+{
+    int err, i, n = IPC_RANGE_NPAGES(srcva);
+    char *src = IPC_RANGE_VA(srcva), *dst = IPC_RANGE_VA(dstva);
+    struct PageInfo *pp;
+    if (n > IPC_RANGE_NPAGES(dstva)) {
+        return -E_INVAL;
+    }
+    for (i = 0; i < n; i++) {
+        if ((err = ipc_lookup_page(src + i * PGSIZE, perm, &pp)) ||
+            (err = page_insert(e->env_pgdir, pp, dst + i * PGSIZE, perm))) {
+            while (i-- > 0) {
+                page_remove(e->env_pgdir, dst + i * PGSIZE);
+            }
+            return err;
+        }
+    }
+    return 0;
+}
+
+// Queue a message for e, which is not receiving, taking a reference to
+// each page sent.  The caller holds e's IPC lock.
+// Returns 1, or -E_IPC_NOT_RECV if e's queue is full, or the errors of
+// sys_ipc_try_send.
+static int
+ipc_enqueue(struct Env *e, uint32_t value, void *srcva, unsigned perm)
+{
+    int err = 0, i, n = 0;
+    struct IpcQueue *q;
+    struct IpcMsg *m;
+    struct PageInfo **pps;
+    if ((q = e->env_ipc_queue) == NULL) {
+        if ((q = kmalloc(sizeof(struct IpcQueue), ALLOC_ZERO)) == NULL) {
+            return -E_NO_MEM;
+        }
+        e->env_ipc_queue = q;
+    }
+    if (q->iq_count == IPC_QUEUE_LEN) {
+        return -E_IPC_NOT_RECV;
+    }
+    m = &q->iq_msgs[(q->iq_head + q->iq_count) % IPC_QUEUE_LEN];
+    pps = &m->im_page;
+    if ((uintptr_t)srcva < UTOP) {
+        char *src = IPC_RANGE_VA(srcva);
+        n = IPC_RANGE_NPAGES(srcva);
+        if (n > 1 && (pps = kmalloc(n * sizeof(*pps), 0)) == NULL) {
+            return -E_NO_MEM;
+        }
+        env_lock_vm(curenv, 0);
+        for (i = 0; i < n && !err; i++) {
+            err = ipc_lookup_page(src + i * PGSIZE, perm, &pps[i]);
+        }
+        for (i = 0; i < n && !err; i++) {
+            page_incref(pps[i]);
+        }
+        env_unlock_vm(curenv);
+        if (err) {
+            if (pps != &m->im_page) {
+                kfree(pps);
+            }
+            return err;
+        }
+    }
+    m->im_from = curenv->env_id;
+    m->im_value = value;
+    m->im_pages = pps;
+    m->im_npages = n;
+    m->im_perm = n ? perm : 0;
+    q->iq_count++;
+    return 1;
+}
+
+// Take the oldest message queued for curenv, mapping its pages at the
+// range dstva if it carries any and they fit there.  As for a receiver
+// that was waiting, a grant larger than dstva is not mapped at all and
+// arrives with env_ipc_perm 0.  The caller holds curenv's IPC lock.  Returns 1
+// if there was a message, 0 if the queue is empty, or -E_NO_MEM,
+// leaving the message queued, if the pages cannot be mapped.
+static int
+ipc_dequeue(void *dstva)
+{
+    int err, i, n;
+    struct IpcQueue *q = curenv->env_ipc_queue;
+    struct IpcMsg *m;
+    char *dst = IPC_RANGE_VA(dstva);
+    if (q == NULL || q->iq_count == 0) {
+        return 0;
+    }
+    m = &q->iq_msgs[q->iq_head];
+    n = 0;
+    if (m->im_npages > 0 && (uintptr_t)dstva < UTOP &&
+        m->im_npages <= IPC_RANGE_NPAGES(dstva)) {
+        n = m->im_npages;
+        env_lock_vm(curenv, 0);
+        for (i = 0; i < n; i++) {
+            err = page_insert(curenv->env_pgdir, m->im_pages[i],
+                              dst + i * PGSIZE, m->im_perm);
+            if (err) {
+                while (i-- > 0) {
+                    page_remove(curenv->env_pgdir, dst + i * PGSIZE);
+                }
+                env_unlock_vm(curenv);
+                return err;
+            }
+        }
+        env_unlock_vm(curenv);
+    }
+    for (i = 0; i < m->im_npages; i++) {
+        page_decref(m->im_pages[i]);
+    }
+    if (m->im_pages != &m->im_page) {
+        kfree(m->im_pages);
+    }
+    curenv->env_ipc_perm = n ? m->im_perm : 0;
+    curenv->env_ipc_npages = n;
+    curenv->env_ipc_from = m->im_from;
+    curenv->env_ipc_value = m->im_value;
+    q->iq_head = (q->iq_head + 1) % IPC_QUEUE_LEN;
+    q->iq_count--;
+    return 1;
+}
+
+// Deliver a message to e (looked up by envid) for sys_ipc_try_send and
+// friends, or fail with the errors listed there.  If e is receiving,
+// returns 0 with e still ENV_NOT_RUNNABLE: the caller must get it
+// running.  Otherwise the message joins e's queue and 1 is returned.
+//
+// sys_ipc_try_send calls this without the kernel lock: e's IPC lock
+// makes the check-and-clear of env_ipc_recving atomic against other
+// senders.
+static int
+ipc_deliver(struct Env *e, envid_t envid, uint32_t value, void *srcva,
+            unsigned perm)
+{
+    int err = 0;
+    if ((uintptr_t)srcva < UTOP) {
+        if (PGOFF(srcva)) {
+            return -E_INVAL;
+        }
+        srcva = IPC_RANGE(srcva, IPC_PERM_GET_NPAGES(perm));
+    }
+    perm &= ~IPC_PERM_NPAGES_MASK;
+    if (!ipc_range_ok(srcva)) {
+        return -E_INVAL;
+    }
+    env_lock_ipc(e);
+    if (e->env_status == ENV_FREE || e->env_id != envid) {
+        err = -E_BAD_ENV;
+        goto out;
+    }
+    if (!e->env_ipc_recving) {
+        err = ipc_enqueue(e, value, srcva, perm);
+        goto out;
+    }
+    // A grant larger than the receive window is not mapped at all, as
+    // in ipc_dequeue.
+    if ((uintptr_t)srcva < UTOP && (uintptr_t)e->env_ipc_dstva < UTOP &&
+        IPC_RANGE_NPAGES(srcva) <= IPC_RANGE_NPAGES(e->env_ipc_dstva)) {
+        if ((err = env_lock_vm2(curenv, 0, e, envid))) {
+            goto out;
+        }
+        err = ipc_map_range(e, srcva, perm, e->env_ipc_dstva);
+        env_unlock_vm2(curenv, e);
+        if (err) {
+            goto out;
+        }
+        e->env_ipc_perm = perm;
+        e->env_ipc_npages = IPC_RANGE_NPAGES(srcva);
+    } else {
+        e->env_ipc_perm = 0;
+        e->env_ipc_npages = 0;
+    }
+    e->env_ipc_recving = false;
+    e->env_ipc_from = curenv->env_id;
+    e->env_ipc_value = value;
+    e->env_tf.tf_regs.reg_eax = 0;
+out:
+    env_unlock_ipc(e);
+    return err;
+}
+
+// Whether e, to which ipc_deliver succeeded, is still waiting to be
+// woken up.  The caller holds the kernel lock.
+static bool
+ipc_delivered(struct Env *e, envid_t envid)
+{
+    return e->env_id == envid && e->env_status == ENV_NOT_RUNNABLE &&
+           !e->env_ipc_recving;
+}
+
+// Put e, which ipc_deliver just handed a message, back on a run queue.
+// The caller holds the kernel lock.
+static void
+ipc_wake(struct Env *e, envid_t envid)
+{
+    if (ipc_delivered(e, envid)) {
+        e->env_status = ENV_RUNNABLE;
+        sched_enqueue(e);
+    }
+}
+
+// Give this CPU directly to e, which ipc_deliver just handed a message,
+// rather than queueing it.  curenv is blocked, so nothing is preempted.
+// If e may not run on this CPU, queue it where it may instead.
+// The caller holds the kernel lock.
+static void __attribute__((noreturn))
+ipc_switch(struct Env *e, envid_t envid)
+{
+    if (ipc_delivered(e, envid) && sched_allowed(e, cpunum())) {
+        env_run(e);
+    }
+    ipc_wake(e, envid);
+    sched_yield();
+}
+
+// Receive into dstva for sys_ipc_recv and friends: take the oldest
+// queued message and return 1 if there is one, or else mark curenv as
+// blocked receiving and return 0, after which the caller must give up
+// the CPU.  Returns -E_NO_MEM if a queued page cannot be mapped.
+static int
+ipc_receive(void *dstva)
+{
+    int r;
+    if ((uintptr_t)dstva >= UTOP) {
+        dstva = (void *)0xffffffff;
+    }
+    env_lock_ipc(curenv);
+    if ((r = ipc_dequeue(dstva)) == 0) {
+        // Senders check env_ipc_recving without the kernel lock, so we
+        // must be ENV_NOT_RUNNABLE before it becomes visible.
+        curenv->env_status = ENV_NOT_RUNNABLE;
+        curenv->env_ipc_dstva = dstva;
+        curenv->env_ipc_recving = true;
+    }
+    // Let senders sleeping in ipc_send retry: we are receiving, or
+    // there is room in our queue again.  Bumping env_ipc_seq under the
+    // IPC lock means a sender that failed before this sees it change.
+    if (r >= 0) {
+        curenv->env_ipc_seq++;
+    }
+    env_unlock_ipc(curenv);
+    if (r >= 0) {
+        wait_wake(PADDR(&curenv->env_ipc_seq), NENV);
+    }
+    return r;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
+// With IPC_PERM_NPAGES(n) in perm, the n pages from srcva on are
+// granted in one message, mapped at the start of the receiver's range.
 //
-// The send fails with a return value of -E_IPC_NOT_RECV if the
-// target is not blocked, waiting for an IPC.
+// If the target is not blocked, waiting for an IPC, the message is
+// queued for its next sys_ipc_recv, holding a reference to the page.
+// The send fails with a return value of -E_IPC_NOT_RECV only if the
+// target's queue (IPC_QUEUE_LEN messages) is full.
 //
 // The send also can fail for the other reasons listed below.
 //
@@ -320,22 +823,25 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
 //
 // If the sender wants to send a page but the receiver isn't asking for one,
-// then no page mapping is transferred, but no error occurs.
+// or is asking for fewer pages than sent, then no page mapping is
+// transferred, but no error occurs.  This holds for a queued message too.
 // The ipc only happens when no errors occur.
 //
 // Returns 0 on success, < 0 on error.
 // Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist.
 //		(No need to check permissions.)
-//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
+//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv
+//		and its message queue is full.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
+//	-E_INVAL if srcva < UTOP but the range runs past UTOP.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
 //	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
@@ -343,7 +849,7 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
-//		address space.
+//		address space, or to queue the message.
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
@@ -353,38 +859,20 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     if ((err = envid2env(envid, &e, 0))) {
         return err;
     }
-    if (!e->env_ipc_recving) {
-        return -E_IPC_NOT_RECV; 
-    }
-    if ((uintptr_t)srcva < UTOP && (uintptr_t)e->env_ipc_dstva < UTOP) {
-        if (((uintptr_t)srcva & 0xfff)) {
-            return -E_INVAL;
-        }
-        if (!(perm & PTE_P) || !(perm & PTE_U) || (perm & ~PTE_SYSCALL)) {
-            return -E_INVAL;
-        }
-        pte_t *pte;
-        struct PageInfo *pp;
-        if ((pp = page_lookup(curenv->env_pgdir, srcva, &pte)) == NULL) {
-            return -E_INVAL;
-        }
-        if (!(*pte & PTE_W) && (perm & PTE_W)) {
-            return -E_INVAL;
-        }
-        if ((err = page_insert(e->env_pgdir, pp, e->env_ipc_dstva, perm))) {
-            return err;
-        }
-        e->env_ipc_perm = perm;
-    } else {
-        e->env_ipc_perm = 0;
+    envid = e->env_id;
+    if ((err = ipc_deliver(e, envid, value, srcva, perm)) != 0) {
+        return err < 0 ? err : 0;
     }
-    e->env_ipc_recving = false;
-    e->env_ipc_from = curenv->env_id;
-    e->env_ipc_value = value;
-    e->env_tf.tf_regs.reg_eax = 0;
-    e->env_status = ENV_RUNNABLE;
+
+    // Run queues still belong to the kernel lock.  The receiver set
+    // ENV_NOT_RUNNABLE before env_ipc_recving, and keeps the kernel
+    // lock until it has switched away, so by the time we get the lock
+    // it is safe to requeue -- unless it was freed meanwhile, or
+    // somebody else already woke it and it is receiving again.
+    lock_kernel();
+    ipc_wake(e, envid);
+    unlock_kernel();
     return 0;
-    
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -393,31 +881,117 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
+// It is an IPC page range (see IPC_RANGE): the receive window, which
+// bounds how many pages a sender may grant.
+//
+// If a message is already queued, receive it and return 0 at once.
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
-//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but the range runs past UTOP.
+//	-E_NO_MEM if the page of the queued message cannot be mapped.
 static int
 sys_ipc_recv(void *dstva)
 {
 	// LAB 4: Your code here.
-    if ((uintptr_t)dstva < UTOP) {
-        if ((uintptr_t)dstva & 0xfff) {
-            return -E_INVAL;
-        }
-        curenv->env_ipc_dstva = dstva;
-    } else {
-        curenv->env_ipc_dstva = (void *)0xffffffff;
+    int r;
+    if (!ipc_range_ok(dstva)) {
+        return -E_INVAL;
+    }
+    if ((r = ipc_receive(dstva)) != 0) {
+        return r < 0 ? r : 0;
     }
-    curenv->env_ipc_recving = true;
-    curenv->env_status = ENV_NOT_RUNNABLE;
     sched_yield();
     // If no error occurs, receiver never return from this system call.
     // We expects the sender to pop the receiver from trapframe by
     // marking it as runnable.
 }
 
+// Send like sys_ipc_try_send, then receive like sys_ipc_recv, in one
+// system call.  If the receiver was waiting for the message, rather
+// than queueing it for the scheduler to get to, this CPU switches
+// straight to it, so a client calling a server that waits in
+// sys_ipc_recv or sys_ipc_reply_wait runs the server at once.
+//
+// As with sys_ipc_recv, the reply is the first message received, or
+// one that was already queued, and the system call returns 0 once it
+// is here.  Errors are those of sys_ipc_try_send, with nothing sent,
+// those of sys_ipc_recv, plus:
+//	-E_INVAL if dstva < UTOP but the range runs past UTOP.
+// The receive window is checked before sending, but a queued reply
+// whose pages cannot be mapped only shows up after the request went
+// out: -E_NO_MEM means the request may have been sent, and the reply
+// stays queued for the next receive.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+             void *dstva)
+{
+    int sent, r;
+    struct Env *e;
+    if (!ipc_range_ok(dstva)) {
+        return -E_INVAL;
+    }
+    if ((sent = envid2env(envid, &e, 0))) {
+        return sent;
+    }
+    envid = e->env_id;
+    if ((sent = ipc_deliver(e, envid, value, srcva, perm)) < 0) {
+        return sent;
+    }
+    r = ipc_receive(dstva);
+    if (sent == 0) {
+        if (r == 0) {
+            ipc_switch(e, envid);
+        }
+        ipc_wake(e, envid);
+    }
+    if (r != 0) {
+        return r < 0 ? r : 0;
+    }
+    sched_yield();
+}
+
+// The server side of sys_ipc_call: reply to the client 'envid' as
+// sys_ipc_try_send would, then wait for the next request as
+// sys_ipc_recv would, switching straight to the client if it was
+// waiting for the reply.  An envid of 0 sends no reply.  If the client
+// is gone, the reply is dropped and the server still waits.
+//
+// Like sys_ipc_recv, this only returns on error or with a request that
+// was already queued.  Errors are those of sys_ipc_try_send other than
+// -E_BAD_ENV, with no reply sent, those of sys_ipc_recv, plus:
+//	-E_INVAL if dstva < UTOP but the range runs past UTOP.
+// As with sys_ipc_call, -E_NO_MEM may follow a reply that was sent.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+                   void *dstva)
+{
+    int sent = -E_BAD_ENV, r;
+    struct Env *e;
+    if (!ipc_range_ok(dstva)) {
+        return -E_INVAL;
+    }
+    if (envid != 0 && envid2env(envid, &e, 0) == 0) {
+        envid = e->env_id;
+        sent = ipc_deliver(e, envid, value, srcva, perm);
+        if (sent < 0 && sent != -E_BAD_ENV) {
+            return sent;
+        }
+    }
+    r = ipc_receive(dstva);
+    if (sent == 0) {
+        if (r == 0) {
+            ipc_switch(e, envid);
+        }
+        ipc_wake(e, envid);
+    }
+    if (r != 0) {
+        return r < 0 ? r : 0;
+    }
+    sched_yield();
+}
+
 
 static int 
 sys_exec_config_pgdir_alloc(envid_t envid) 
@@ -427,14 +1001,16 @@ sys_exec_config_pgdir_alloc(envid_t envid)
     if ((err = envid2env(envid, &e, 1))) {
         return err;
     }
+    if ((err = env_lock_vm(e, envid))) {
+        return err;
+    }
     if (e->exec_pgdir != NULL) {
         env_free_pgdir(e->exec_pgdir);
+        e->exec_pgdir = NULL;
     }
-    if ((err = env_alloc_pgdir(&e->exec_pgdir))) {
-        return err;
-    }
-
-    return 0;
+    err = env_alloc_pgdir(&e->exec_pgdir);
+    env_unlock_vm(e);
+    return err;
 }
 
 
@@ -452,17 +1028,24 @@ sys_exec_config_page_alloc(envid_t envid, void *va, int perm)
     if (!(perm & PTE_P) || !(perm & PTE_U) || (perm & ~PTE_SYSCALL)) {
         return -E_INVAL;
     }
-    if (e->exec_pgdir == NULL) {
-        return -E_INVAL;
-    }
     struct PageInfo *pp;
     if ((pp = page_alloc(ALLOC_ZERO)) == NULL) {
         return -E_NO_MEM;
     }
-    if ((err = page_insert(e->exec_pgdir, pp, va, perm))) {
+    if ((err = env_lock_vm(e, envid))) {
+        page_free(pp);
         return err;
     }
-    return 0;
+    if (e->exec_pgdir == NULL) {
+        err = -E_INVAL;
+    } else {
+        err = page_insert(e->exec_pgdir, pp, va, perm);
+    }
+    env_unlock_vm(e);
+    if (err) {
+        page_free(pp);
+    }
+    return err;
 }
 
 
@@ -485,24 +1068,31 @@ sys_exec_config_page_map(envid_t srcenvid, void *srcva,
     if (dstva >= (void *)UTOP || ((uintptr_t)dstva & 0xfff)) {
         return -E_INVAL;
     }
-    if (!(perm & PTE_P) || !(perm & PTE_U) || (perm & ~PTE_SYSCALL)) {
+    if (!(perm & PTE_P) || !(perm & PTE_U) || (perm & ~(PTE_SYSCALL | PTE_PS))) {
         return -E_INVAL;
     }
-    if (dstenv->exec_pgdir == NULL) {
+    if ((perm & PTE_PS) && 
+        (((uintptr_t)srcva | (uintptr_t)dstva) & (PTSIZE - 1))) {
         return -E_INVAL;
     }
     pte_t *pte;
     struct PageInfo *pp;
-    if ((pp = page_lookup(srcenv->env_pgdir, srcva, &pte)) == NULL) {
-        return -E_INVAL;
-    }
-    if (!(*pte & PTE_W) && (perm & PTE_W)) {
-        return -E_INVAL;
-    }
-    if ((err = page_insert(dstenv->exec_pgdir, pp, dstva, perm))) {
+    if ((err = env_lock_vm2(srcenv, srcenvid, dstenv, dstenvid))) {
         return err;
     }
-    return 0;
+    if (dstenv->exec_pgdir == NULL) {
+        err = -E_INVAL;
+    } else if ((pp = page_lookup(srcenv->env_pgdir, srcva, &pte)) == NULL) {
+        err = -E_INVAL;
+    } else if (!(*pte & PTE_W) && (perm & PTE_W)) {
+        err = -E_INVAL;
+    } else if ((perm & PTE_PS) && !(*pte & PTE_PS)) {
+        err = -E_INVAL;
+    } else {
+        err = page_insert(dstenv->exec_pgdir, pp, dstva, perm);
+    }
+    env_unlock_vm2(srcenv, dstenv);
+    return err;
 }
 
 static int
@@ -516,11 +1106,16 @@ sys_exec_config_page_unmap(envid_t envid, void *va)
     if (va >= (void *)UTOP || ((uintptr_t)va & 0xfff)) {
         return -E_INVAL;
     }
+    if ((err = env_lock_vm(e, envid))) {
+        return err;
+    }
     if (e->exec_pgdir == NULL) {
-        return -E_INVAL;
+        err = -E_INVAL;
+    } else {
+        page_remove(e->exec_pgdir, va);
     }
-    page_remove(e->exec_pgdir, va);
-    return 0;
+    env_unlock_vm(e);
+    return err;
 }
 
 static int
@@ -534,15 +1129,82 @@ sys_exec(envid_t envid, struct Trapframe *tf)
     if ((err = sys_env_set_trapframe(envid, tf))) {
         return err;
     }
+    if ((err = env_lock_vm(e, envid))) {
+        return err;
+    }
     if (e == curenv) {
-        lcr3(PADDR(kern_pgdir));
+        pgdir_load(kern_pgdir);
     }
     env_free_pgdir(e->env_pgdir);
     e->env_pgdir = e->exec_pgdir;
     e->exec_pgdir = 0;
+    env_unlock_vm(e);
     return 0;
 }
 
+static int
+page_batch_op(const struct PageOp *op)
+{
+    switch (op->op) {
+        case PAGEOP_ALLOC:
+            return sys_page_alloc(op->dstenv, op->dstva, op->perm);
+        case PAGEOP_MAP:
+            return sys_page_map(op->srcenv, op->srcva, 
+                                op->dstenv, op->dstva, op->perm);
+        case PAGEOP_UNMAP:
+            return sys_page_unmap(op->dstenv, op->dstva);
+        case PAGEOP_EXEC_ALLOC:
+            return sys_exec_config_page_alloc(op->dstenv, op->dstva, op->perm);
+        case PAGEOP_EXEC_MAP:
+            return sys_exec_config_page_map(op->srcenv, op->srcva, 
+                                            op->dstenv, op->dstva, op->perm);
+        default:
+            return -E_INVAL;
+    }
+}
+
+// Operations copied into the kernel per step of sys_page_batch.
+#define PAGEOP_CHUNK	16
+
+// Perform the n page operations in 'ops' (see struct PageOp) in order,
+// in one kernel entry and with one TLB flush rather than one per page.
+// Processing stops at the first operation that fails; the ones before
+// it stay done.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if n < 0 or an operation has an unknown op code.
+//	-E_FAULT if ops is not readable by the caller.
+//	Any error of the system call an operation corresponds to.
+static int
+sys_page_batch(const struct PageOp *ops, int n)
+{
+    struct PageOp chunk[PAGEOP_CHUNK];
+    int err = 0;
+    if (n < 0) {
+        return -E_INVAL;
+    }
+    tlb_batch_begin();
+    for (int i = 0; i < n && !err; i += PAGEOP_CHUNK) {
+        int m = MIN(n - i, PAGEOP_CHUNK);
+        // Earlier operations may have remapped the array itself, and
+        // we run without the kernel lock: copy it in under our own
+        // address-space lock.
+        tlb_batch_flush();
+        env_lock_vm(curenv, 0);
+        if (user_mem_check(curenv, ops + i, m * sizeof(struct PageOp), PTE_U) < 0) {
+            err = -E_FAULT;
+        } else {
+            memcpy(chunk, ops + i, m * sizeof(struct PageOp));
+        }
+        env_unlock_vm(curenv);
+        for (int j = 0; j < m && !err; j++) {
+            err = page_batch_op(&chunk[j]);
+        }
+    }
+    tlb_batch_end();
+    return err;
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -551,6 +1213,90 @@ sys_time_msec(void)
     return time_msec();
 }
 
+// Translate the user word at 'va' into the physical address that
+// names its wait channel and, if val_store is nonnull, read the word.
+// The word must be 4-byte aligned and mapped user-readable in the
+// current environment.  The lookup and the read hold curenv's address
+// space lock, since page_unmap runs without the kernel lock and could
+// otherwise free the page under us.
+static int
+wait_key(void *va, physaddr_t *key_store, uint32_t *val_store)
+{
+    pte_t *pte;
+    struct PageInfo *pp;
+    int err = 0;
+    if ((uintptr_t)va >= ULIM || ((uintptr_t)va & 3)) {
+        return -E_INVAL;
+    }
+    env_lock_vm(curenv, 0);
+    if ((pp = page_lookup(curenv->env_pgdir, va, &pte)) == NULL ||
+        (*pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U)) {
+        err = -E_INVAL;
+    } else {
+        *key_store = page2pa(pp) + PGOFF(va);
+        if (val_store != NULL) {
+            *val_store = *(uint32_t *)KADDR(*key_store);
+        }
+    }
+    env_unlock_vm(curenv);
+    return err;
+}
+
+// Sleep until another environment calls sys_wake on the word at 'va',
+// but only if that word still holds 'expected'.  If 'timeout' is nonzero,
+// give up after that many milliseconds.
+//
+// Like sys_ipc_recv, this only returns on error; otherwise the system
+// call eventually returns 0 when woken, or -E_TIMEOUT.
+// Errors are:
+//	-E_INVAL if va is not aligned or not mapped user-readable.
+//	-E_AGAIN if *va != expected.
+static int
+sys_wait_on(void *va, uint32_t expected, uint32_t timeout)
+{
+    int err;
+    physaddr_t key;
+    uint32_t val;
+    if ((err = wait_key(va, &key, &val))) {
+        return err;
+    }
+    if (val != expected) {
+        return -E_AGAIN;
+    }
+    wait_sleep(curenv, key, timeout);
+    sched_yield();
+}
+
+// Wake up to n environments sleeping on the word at 'va'.
+// Returns the number of environments woken, or -E_INVAL.
+static int
+sys_wake(void *va, int n)
+{
+    int err;
+    physaddr_t key;
+    if (n <= 0) {
+        return -E_INVAL;
+    }
+    if ((err = wait_key(va, &key, NULL))) {
+        return err;
+    }
+    return wait_wake(key, n);
+}
+
+// Sleep for 'msec' milliseconds, for environments that have to poll
+// something nobody can wake them for.  A zero msec just yields.
+// Like sys_wait_on, this only returns once the time is up, with 0.
+static int
+sys_sleep(uint32_t msec)
+{
+    if (msec == 0) {
+        curenv->env_tf.tf_regs.reg_eax = 0;
+        sched_yield();
+    }
+    wait_nap(curenv, msec);
+    sched_yield();
+}
+
 static int
 sys_transmit_packet(void *va, size_t n) {
     user_mem_assert(curenv, va, n, 0);
@@ -563,6 +1309,27 @@ sys_recv_packet(void *va, size_t max_n) {
     return recv_packet(va, max_n);
 }
 
+// System calls that only need the page allocator, address-space and IPC
+// locks run without the big kernel lock, so that they proceed in parallel
+// on different CPUs.  Anything that touches the scheduler, wait channels,
+// devices or creates and destroys environments still takes it.
+bool
+syscall_needs_kernel_lock(uint32_t syscallno)
+{
+    switch (syscallno) {
+        case SYS_getenvid:
+        case SYS_page_alloc:
+        case SYS_page_map:
+        case SYS_page_unmap:
+        case SYS_page_batch:
+        case SYS_ipc_try_send:
+        case SYS_time_msec:
+            return false;
+        default:
+            return true;
+    }
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -570,6 +1337,7 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// Call the function corresponding to the 'syscallno' parameter.
 	// Return any appropriate return value.
 	// LAB 3: Your code here.
+    kstat_syscall(syscallno);
 
 	switch (syscallno) {
         case SYS_cputs:
@@ -601,9 +1369,18 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
         case SYS_exofork:
             return sys_exofork();
 
+        case SYS_fork:
+            return sys_fork();
+
         case SYS_env_set_status:
             return sys_env_set_status((envid_t)a1, a2);
 
+        case SYS_env_set_sched:
+            return sys_env_set_sched((envid_t)a1, a2, a3);
+
+        case SYS_env_set_affinity:
+            return sys_env_set_affinity((envid_t)a1, a2);
+
         case SYS_env_set_pgfault_upcall:
             return sys_env_set_pgfault_upcall((envid_t)a1, (void *)a2);
 
@@ -613,6 +1390,12 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
         case SYS_ipc_recv:
             return sys_ipc_recv((void *)a1);
 
+        case SYS_ipc_call:
+            return sys_ipc_call((envid_t)a1, a2, (void *)a3, a4, (void *)a5);
+
+        case SYS_ipc_reply_wait:
+            return sys_ipc_reply_wait((envid_t)a1, a2, (void *)a3, a4, (void *)a5);
+
         case SYS_env_set_trapframe:
             return sys_env_set_trapframe((envid_t)a1, (struct Trapframe *)a2);
 
@@ -634,12 +1417,24 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
         case SYS_time_msec:
             return sys_time_msec();
 
+        case SYS_wait_on:
+            return sys_wait_on((void *)a1, a2, a3);
+
+        case SYS_wake:
+            return sys_wake((void *)a1, (int)a2);
+
+        case SYS_sleep:
+            return sys_sleep(a1);
+
         case SYS_transmit_packet:
             return sys_transmit_packet((void *)a1, (size_t)a2);
 
         case SYS_recv_packet:
             return sys_recv_packet((void *)a1, (size_t)a2);
 
+        case SYS_page_batch:
+            return sys_page_batch((const struct PageOp *)a1, a2);
+
         default:
             return -E_INVAL;
 	}
@@ -1,26 +1,43 @@
 #include <kern/time.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
-static unsigned int ticks;
+// Time is kept by the TSC, so that it goes on while idle CPUs sleep
+// without timer interrupts (see sched_halt).  time_init calibrates it
+// against channel 2 of the 8254 PIT, the one wired to the speaker
+// gate, which needs no interrupt.
+#define IO_PIT_CH2	0x42		// Channel 2 counter
+#define IO_PIT_MODE	0x43		// Mode/command register
+#define IO_PIT_GATE	0x61		// Channel 2 gate and output
+#define PIT_HZ		1193182
+#define PIT_CALIBRATE_MS 10
+
+static uint64_t tsc_boot;
+static uint64_t tsc_per_msec;
 
 void
 time_init(void)
 {
-	ticks = 0;
-}
+	uint16_t count = PIT_HZ * PIT_CALIBRATE_MS / 1000;
+	uint64_t start;
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
-void
-time_tick(void)
-{
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	// Gate channel 2 on, with the speaker off, and count down once
+	// (mode 0): its output goes high when the count reaches zero.
+	outb(IO_PIT_GATE, (inb(IO_PIT_GATE) & ~0x02) | 0x01);
+	outb(IO_PIT_MODE, 0xb0);
+	outb(IO_PIT_CH2, count & 0xff);
+	outb(IO_PIT_CH2, count >> 8);
+	start = read_tsc();
+	while (!(inb(IO_PIT_GATE) & 0x20))
+		;
+	tsc_boot = read_tsc();
+	tsc_per_msec = (tsc_boot - start) / PIT_CALIBRATE_MS;
+	if (tsc_per_msec == 0)
+		panic("time_init: TSC does not count");
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return (read_tsc() - tsc_boot) / tsc_per_msec;
 }
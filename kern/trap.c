@@ -4,12 +4,15 @@
 #include <inc/x86.h>
 #include <inc/assert.h>
 #include <inc/string.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
 #include <kern/console.h>
 #include <kern/monitor.h>
 #include <kern/env.h>
+#include <kern/fpu.h>
+#include <kern/kstats.h>
 #include <kern/syscall.h>
 #include <kern/sched.h>
 #include <kern/kclock.h>
@@ -17,6 +20,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/wait.h>
 
 static struct Taskstate ts;
 
@@ -103,6 +107,8 @@ trap_init(void)
         [IRQ_OFFSET + IRQ_SERIAL]   =  HANDLER_IRQ_SERIAL,
         [IRQ_OFFSET + IRQ_SPURIOUS] =  HANDLER_IRQ_SPURIOUS,
         [IRQ_OFFSET + IRQ_IDE]      =  HANDLER_IRQ_IDE,
+        [IRQ_OFFSET + IRQ_TLB]      =  HANDLER_IRQ_TLB,
+        [IRQ_OFFSET + IRQ_RESCHED]  =  HANDLER_IRQ_RESCHED,
     };  
         
 	// LAB 3: Your code here.
@@ -126,11 +132,23 @@ trap_init(void)
     SETGATE(idt[IRQ_OFFSET + IRQ_SERIAL], 0, GD_KT,   handler[IRQ_OFFSET + IRQ_SERIAL], 0);
     SETGATE(idt[IRQ_OFFSET + IRQ_SPURIOUS], 0, GD_KT, handler[IRQ_OFFSET + IRQ_SPURIOUS], 0);
     SETGATE(idt[IRQ_OFFSET + IRQ_IDE], 0, GD_KT,      handler[IRQ_OFFSET + IRQ_IDE], 0);
+    SETGATE(idt[IRQ_OFFSET + IRQ_TLB], 0, GD_KT,      handler[IRQ_OFFSET + IRQ_TLB], 0);
+    SETGATE(idt[IRQ_OFFSET + IRQ_RESCHED], 0, GD_KT,  handler[IRQ_OFFSET + IRQ_RESCHED], 0);
 
 	// Per-CPU setup 
   	trap_init_percpu();
 }
 
+// Whether this CPU has sysenter and sysexit.
+static bool
+sysenter_supported(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	return (edx & CPUID_EDX_SEP) != 0;
+}
+
 // Initialize and load the per-CPU TSS and IDT
 void
 trap_init_percpu(void)
@@ -190,6 +208,15 @@ trap_init_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+	// Let user environments enter system calls with sysenter, which
+	// lands on this CPU's kernel stack.  sysexit derives the user
+	// segments from GD_KT: GD_UT and GD_UD must follow GD_KD.
+	if (sysenter_supported()) {
+		wrmsr(MSR_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_SYSENTER_ESP, this_kstacktop);
+		wrmsr(MSR_SYSENTER_EIP, (uintptr_t) sysenter_handler);
+	}
 }
 
 void
@@ -241,26 +268,7 @@ print_regs(struct PushRegs *regs)
 static void
 trap_dispatch(struct Trapframe *tf)
 {
-    // invalidating all the breakpoints
-    // note: env_run is responsible to revalidating them
-    if (curenv != NULL) {
-        for (size_t i = 0; i < curenv->bpnum; i++) {
-            struct PageInfo *pp;
-            uintptr_t bp_va = curenv->bp[i].va;
-            if ((pp = page_lookup(curenv->env_pgdir, (void *)bp_va, 0)) == NULL) {
-                cprintf("warning: unreachable breakpoint at 0x%x\n", bp_va);
-                continue;
-            }
-            unsigned char *victim = page2kva(pp) + PGOFF(bp_va); 
-            *victim = curenv->bp[i].victim;
-            // make sure the breakpoint is the one set by the kernel monitor 
-            // instead of int 0x3.
-            if (tf->tf_trapno == T_BRKPT && tf->tf_eip - 1 == bp_va) {
-                tf->tf_eip -= 1;
-            }
-        }
-    }
-
+    kstat_trap(tf->tf_trapno);
 
 	// Handle processor exceptions.
 	// LAB 3: Your code here.
@@ -269,7 +277,26 @@ trap_dispatch(struct Trapframe *tf)
         return;
     } 
 
+    // First FPU or SSE instruction since this CPU switched to curenv.
+    if (tf->tf_trapno == T_DEVICE && (tf->tf_cs & 3) == 3) {
+        int err;
+        if ((err = fpu_trap()) < 0) {
+            lock_kernel_if_needed();
+            cprintf("[%08x] cannot use the FPU: %e\n", curenv->env_id, err);
+            env_destroy(curenv);
+        }
+        return;
+    }
+
     if (tf->tf_trapno == T_DEBUG || tf->tf_trapno == T_BRKPT) {
+        // A breakpoint in DR0-DR3 faults before its instruction runs:
+        // RF lets the instruction run when the environment resumes.
+        if (tf->tf_trapno == T_DEBUG) {
+            if (rdr6() & DR6_BMASK) {
+                tf->tf_eflags |= FL_RF;
+            }
+            ldr6(0);
+        }
         cprintf("Environment [%x] stopped at 0x%x\n", curenv->env_id, tf->tf_eip);
         monitor(tf);
         return;
@@ -305,9 +332,23 @@ trap_dispatch(struct Trapframe *tf)
 	// LAB 4: Your code here.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
         lapic_eoi();
-        time_tick();
+        wait_expire(time_msec());
         // never return
-        sched_yield();
+        sched_tick();
+	}
+
+	// Handle TLB shootdown requests from other CPUs.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		lapic_eoi();
+		tlb_shootdown_intr();
+		return;
+	}
+
+	// Another CPU queued work for us while we were halted.  trap()
+	// goes on to sched_yield(), which picks it up.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED) {
+		lapic_eoi();
+		return;
 	}
 
 	// Add time tick increment to clock interrupts.
@@ -338,8 +379,41 @@ trap_dispatch(struct Trapframe *tf)
 	}
 }
 
-void
-trap(struct Trapframe *tf)
+// Page faults, TLB shootdown IPIs, FPU loads and the system calls
+// listed in syscall_needs_kernel_lock only touch the page allocator,
+// address spaces, IPC state and this CPU's registers, which have their
+// own locks, so they run without the big kernel lock.
+static bool
+trap_needs_kernel_lock(struct Trapframe *tf)
+{
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB)
+		return false;
+	if (tf->tf_trapno == T_PGFLT)
+		return false;
+	if (tf->tf_trapno == T_DEVICE)
+		return false;
+	if (tf->tf_trapno == T_SYSCALL)
+		return syscall_needs_kernel_lock(tf->tf_regs.reg_eax);
+	return true;
+}
+
+// Read the return address of a system call made with sysenter, which
+// the library left on top of the user stack, into tf_eip.
+static int
+sysenter_fetch_eip(struct Trapframe *tf)
+{
+	int err;
+
+	env_lock_vm(curenv, 0);
+	err = user_mem_check(curenv, (void *) tf->tf_esp, sizeof(uint32_t), PTE_U);
+	if (err == 0)
+		tf->tf_eip = *(uint32_t *) tf->tf_esp;
+	env_unlock_vm(curenv);
+	return err;
+}
+
+static void __attribute__((noreturn))
+trap_enter(struct Trapframe *tf, bool sysenter)
 {
 	// The environment may have set DF and some versions
 	// of GCC rely on DF being clear
@@ -352,8 +426,10 @@ trap(struct Trapframe *tf)
 
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED) {
 		lock_kernel();
+		lapic_timer_periodic();
+	}
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -362,22 +438,37 @@ trap(struct Trapframe *tf)
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
 		// Acquire the big kernel lock before doing any
-		// serious kernel work.
+		// serious kernel work, unless this trap only needs
+		// the fine-grained locks.
 		// LAB 4: Your code here.
-        lock_kernel();
 		assert(curenv);
+		if (trap_needs_kernel_lock(tf))
+			lock_kernel();
 
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
+			lock_kernel_if_needed();
 			env_free(curenv);
 			curenv = NULL;
 			sched_yield();
 		}
 
+		if (sysenter && sysenter_fetch_eip(tf) < 0) {
+			lock_kernel_if_needed();
+			cprintf("[%08x] bad sysenter stack %08x\n",
+				curenv->env_id, tf->tf_esp);
+			env_destroy(curenv);
+		}
+		if (sysenter && thiscpu->cpu_sysenter_step) {
+			thiscpu->cpu_sysenter_step = false;
+			tf->tf_eflags |= FL_TF;
+		}
+
 		// Copy trap frame (which is currently on the stack)
 		// into 'curenv->env_tf', so that running the environment
 		// will restart at the trap point.
 		curenv->env_tf = *tf;
+		curenv->env_sysexit = sysenter;
 		// The trapframe on the stack should be ignored from here on.
 		tf = &curenv->env_tf;
 	}
@@ -394,15 +485,76 @@ trap(struct Trapframe *tf)
 	// if doing so makes sense.
 	if (curenv && curenv->env_status == ENV_RUNNING)
 		env_run(curenv);
-	else
-		sched_yield();
+
+	lock_kernel_if_needed();
+	// Another CPU may have marked curenv a zombie while we handled
+	// the trap without the kernel lock.
+	if (curenv && curenv->env_status == ENV_DYING) {
+		env_free(curenv);
+		curenv = NULL;
+	}
+	sched_yield();
+}
+
+void
+trap(struct Trapframe *tf)
+{
+	// sysenter leaves TF set, so an environment single-stepping into
+	// it takes a debug trap at sysenter_handler, in the kernel, which
+	// raises no other.  Go on with the system call, and have
+	// sysenter_trap put TF back so that the step ends when it returns.
+	if (tf->tf_trapno == T_DEBUG && (tf->tf_cs & 3) == 0) {
+		tf->tf_eflags &= ~FL_TF;
+		thiscpu->cpu_sysenter_step = true;
+		return;
+	}
+	trap_enter(tf, false);
+}
+
+// A system call made with sysenter (see sysenter_handler).
+void
+sysenter_trap(struct Trapframe *tf)
+{
+	trap_enter(tf, true);
 }
 
 
+// Resolve a write fault on a copy-on-write 4MB page (see sys_fork):
+// copy the page, or just make it writable if nobody else maps it.
+// Returns 0 if the fault was resolved, 1 if fault_va is not in such a
+// page, or -E_NO_MEM.
+static int
+pgfault_cow_large(uintptr_t fault_va)
+{
+    pde_t *pde;
+    struct PageInfo *pp, *npp;
+    int perm, err = 1;
+    env_lock_vm(curenv, 0);
+    pde = &curenv->env_pgdir[PDX(fault_va)];
+    if ((*pde & (PTE_P | PTE_PS | PTE_COW)) == (PTE_P | PTE_PS | PTE_COW)) {
+        pp = pa2page(PTE_ADDR(*pde));
+        perm = ((*pde & PTE_SYSCALL) & ~PTE_COW) | PTE_W | PTE_PS;
+        if (pp->pp_ref == 1) {
+            *pde = (*pde & ~PTE_COW) | PTE_W;
+            tlb_invalidate(curenv->env_pgdir, (void *)fault_va);
+            err = 0;
+        } else if ((npp = page_alloc_large(0)) == NULL) {
+            err = -E_NO_MEM;
+        } else {
+            memcpy(page2kva(npp), page2kva(pp), PTSIZE);
+            err = page_insert(curenv->env_pgdir, npp, 
+                              ROUNDDOWN((void *)fault_va, PTSIZE), perm);
+        }
+    }
+    env_unlock_vm(curenv);
+    return err;
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	int err;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -418,6 +570,19 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+    // Copy-on-write 4MB pages are copied here: the user-level handler
+    // (lib/fork.c) only deals with 4KB pages.
+    if ((tf->tf_err & FEC_WR) && (err = pgfault_cow_large(fault_va)) <= 0) {
+        if (err == 0) {
+            env_run(curenv);
+        }
+        lock_kernel_if_needed();
+        cprintf("[%08x] out of memory copying 4MB page at va %08x\n", 
+                curenv->env_id, fault_va);
+        env_destroy(curenv);
+        return;
+    }
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -473,15 +638,25 @@ page_fault_handler(struct Trapframe *tf)
             .utf_esp = tf->tf_esp,
         };
         uintptr_t handler_esp = handler_stacktop - sizeof(struct UTrapframe);
-        user_mem_assert(curenv, (void *)handler_esp, sizeof(struct UTrapframe), PTE_W);
+        // Hold curenv's address-space lock so that the exception stack
+        // cannot be unmapped between the check and the copy.
+        env_lock_vm(curenv, 0);
+        if (user_mem_check(curenv, (void *)handler_esp, sizeof(struct UTrapframe), PTE_U | PTE_W) < 0) {
+            env_unlock_vm(curenv);
+            // Destroys curenv, unless the stack was mapped meanwhile,
+            // in which case just take the fault again.
+            user_mem_assert(curenv, (void *)handler_esp, sizeof(struct UTrapframe), PTE_W);
+            env_run(curenv);
+        }
         // Enable curenv->env_pgdir temporarily.
         // Since above UTOP, curenv->env_pgdir has identical mappings as kern_pgdir,
         // we can copy bytes at &utf to [UXSTACKTOP-PGSIZE, UXSTACKTOP) then,
         // the paging of which is only installed at curenv->env_pgdir.
-        lcr3(PADDR(curenv->env_pgdir));
+        pgdir_load(curenv->env_pgdir);
         memcpy((void *)handler_esp, &utf, sizeof(struct UTrapframe));
         // Restore the kernel paging
-        lcr3(PADDR(kern_pgdir));
+        pgdir_load(kern_pgdir);
+        env_unlock_vm(curenv);
         // Set the handler's stack pointer and entry point, 
         // and invoke the handler via env_run().
         curenv->env_tf.tf_esp = handler_esp;
@@ -490,6 +665,7 @@ page_fault_handler(struct Trapframe *tf)
     }
 
 	// Destroy the environment that caused the fault.
+	lock_kernel_if_needed();
 	cprintf("[%08x] user fault va %08x ip %08x\n", curenv->env_id, fault_va, tf->tf_eip);
 	print_trapframe(tf);
 	env_destroy(curenv);
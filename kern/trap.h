@@ -47,5 +47,9 @@ void HANDLER_IRQ_KBD(void);
 void HANDLER_IRQ_SERIAL(void);
 void HANDLER_IRQ_SPURIOUS(void);
 void HANDLER_IRQ_IDE(void);
+void HANDLER_IRQ_TLB(void);
+void HANDLER_IRQ_RESCHED(void);
+
+void sysenter_handler(void);
 
 #endif /* JOS_KERN_TRAP_H */
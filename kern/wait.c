@@ -0,0 +1,171 @@
+// Wait channels: put environments to sleep until another environment
+// (or the kernel) wakes the word they are sleeping on.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/time.h>
+#include <kern/wait.h>
+
+// Sleeping environments, hashed by the physical address of their word
+// and chained through env_wait_link.
+#define NWAITBUCKET	64
+#define WAITHASH(key)	(((key) >> 2) % NWAITBUCKET)
+
+static struct Env *wait_buckets[NWAITBUCKET];
+
+// The key of environments in wait_nap.  Every user word is 4-byte
+// aligned, so no sys_wake can name it and only the timer wakes them.
+#define WAIT_NAP_KEY	1
+
+// Number of sleepers with a deadline, so that the timer tick does not
+// have to look at the buckets when nobody can time out.
+static int wait_ntimed;
+
+// Take e off its bucket and make it runnable again, returning 'ret'
+// from the system call it went to sleep in.
+static void
+wait_release(struct Env **link, int ret)
+{
+    struct Env *e = *link;
+
+    *link = e->env_wait_link;
+    e->env_wait_link = NULL;
+    e->env_wait_key = 0;
+    if (e->env_wait_deadline) {
+        wait_ntimed--;
+        e->env_wait_deadline = 0;
+    }
+    e->env_tf.tf_regs.reg_eax = ret;
+    e->env_status = ENV_RUNNABLE;
+    sched_enqueue(e);
+}
+
+// Park e on the word at physical address 'key'.  If timeout is nonzero,
+// e is woken with -E_TIMEOUT after that many milliseconds.
+// The caller must have checked the word and must call sched_yield()
+// afterwards if e is the current environment.
+void
+wait_sleep(struct Env *e, physaddr_t key, uint32_t timeout)
+{
+    struct Env **bucket = &wait_buckets[WAITHASH(key)];
+
+    assert(key != 0 && e->env_wait_key == 0);
+    e->env_wait_key = key;
+    e->env_wait_deadline = 0;
+    if (timeout) {
+        // 0 means "no deadline", so never compute it by accident
+        e->env_wait_deadline = time_msec() + timeout;
+        if (e->env_wait_deadline == 0) {
+            e->env_wait_deadline = 1;
+        }
+        wait_ntimed++;
+    }
+    e->env_wait_link = *bucket;
+    *bucket = e;
+    e->env_status = ENV_NOT_RUNNABLE;
+    sched_remove(e);
+}
+
+// Park e until 'timeout' (nonzero) milliseconds have passed, after which
+// its system call returns 0.  As for wait_sleep, the caller must call
+// sched_yield() afterwards if e is the current environment.
+void
+wait_nap(struct Env *e, uint32_t timeout)
+{
+    assert(timeout != 0);
+    wait_sleep(e, WAIT_NAP_KEY, timeout);
+}
+
+// Wake up to n environments sleeping on the word at 'key'.
+// Returns the number of environments woken.
+int
+wait_wake(physaddr_t key, int n)
+{
+    struct Env **link = &wait_buckets[WAITHASH(key)];
+    int woken = 0;
+
+    while (*link != NULL && woken < n) {
+        if ((*link)->env_wait_key != key) {
+            link = &(*link)->env_wait_link;
+            continue;
+        }
+        wait_release(link, 0);
+        woken++;
+    }
+    return woken;
+}
+
+// Forget that e is sleeping, e.g. because it is being freed.
+void
+wait_remove(struct Env *e)
+{
+    struct Env **link;
+
+    if (e->env_wait_key == 0) {
+        return;
+    }
+    for (link = &wait_buckets[WAITHASH(e->env_wait_key)]; *link != e;
+         link = &(*link)->env_wait_link) {
+        assert(*link != NULL);
+    }
+    *link = e->env_wait_link;
+    e->env_wait_link = NULL;
+    e->env_wait_key = 0;
+    if (e->env_wait_deadline) {
+        wait_ntimed--;
+        e->env_wait_deadline = 0;
+    }
+}
+
+// Is any environment going to be woken by the timer?
+bool
+wait_has_deadlines(void)
+{
+    return wait_ntimed > 0;
+}
+
+// The earliest deadline of any sleeper, or 0 if none has one.
+unsigned int
+wait_next_deadline(void)
+{
+    unsigned int next = 0;
+
+    if (wait_ntimed == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < NWAITBUCKET; i++) {
+        for (struct Env *e = wait_buckets[i]; e != NULL; e = e->env_wait_link) {
+            if (e->env_wait_deadline &&
+                (next == 0 || (int32_t)(e->env_wait_deadline - next) < 0)) {
+                next = e->env_wait_deadline;
+            }
+        }
+    }
+    return next;
+}
+
+// Wake every sleeper whose deadline has passed.
+// Called on each timer tick.
+void
+wait_expire(unsigned int now)
+{
+    if (wait_ntimed == 0) {
+        return;
+    }
+    for (size_t i = 0; i < NWAITBUCKET; i++) {
+        struct Env **link = &wait_buckets[i];
+        while (*link != NULL) {
+            struct Env *e = *link;
+            if (e->env_wait_deadline && (int32_t)(now - e->env_wait_deadline) >= 0) {
+                // a nap ending is its success, not a timeout
+                wait_release(link,
+                             e->env_wait_key == WAIT_NAP_KEY ? 0 : -E_TIMEOUT);
+                continue;
+            }
+            link = &e->env_wait_link;
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef JOS_KERN_WAIT_H
+#define JOS_KERN_WAIT_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+// Wait channels.  An environment sleeps on a 32-bit word identified by
+// its physical address, so every environment that maps the same page
+// shares the same channels (futex-style).
+void	wait_sleep(struct Env *e, physaddr_t key, uint32_t timeout);
+void	wait_nap(struct Env *e, uint32_t timeout);
+int	wait_wake(physaddr_t key, int n);
+void	wait_remove(struct Env *e);
+void	wait_expire(unsigned int now);
+bool	wait_has_deadlines(void);
+unsigned int wait_next_deadline(void);
+
+#endif	// !JOS_KERN_WAIT_H
@@ -0,0 +1,35 @@
+// Support for the user/bench_* microbenchmarks.  Each one times the
+// iterations of a primitive with the TSC and reports them in a line
+//	bench <name> iters <n> min <cycles> median <cycles> p99 <cycles>
+// that bench-jos collects into its summary.
+
+#include <inc/lib.h>
+
+// The iteration count given as the first argument, or 'dflt' if there
+// is none, limited to 1..BENCH_MAXITERS.
+int
+bench_iters(int argc, char **argv, int dflt)
+{
+	int n = dflt;
+
+	if (argc > 1)
+		n = strtol(argv[1], 0, 0);
+	return MAX(1, MIN(n, BENCH_MAXITERS));
+}
+
+// Report the 'n' cycle counts in 'cycles', sorting them in place.
+void
+bench_report(const char *name, uint64_t *cycles, int n)
+{
+	int i, j;
+	uint64_t c;
+
+	for (i = 1; i < n; i++) {
+		c = cycles[i];
+		for (j = i; j > 0 && cycles[j - 1] > c; j--)
+			cycles[j] = cycles[j - 1];
+		cycles[j] = c;
+	}
+	cprintf("bench %s iters %d min %llu median %llu p99 %llu\n",
+		name, n, cycles[0], cycles[n / 2], cycles[n * 99 / 100]);
+}
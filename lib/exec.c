@@ -16,6 +16,7 @@ map_segment(uintptr_t va, size_t memsz,
 {
     int err;
     size_t va_off;
+    struct PageBatch pb;
     if (memsz < filesz) {
         return -E_INVAL;
     }
@@ -32,9 +33,10 @@ map_segment(uintptr_t va, size_t memsz,
         fileoffset -= va_off;
     }
 
+    pagebatch_init(&pb);
 	for (size_t off = 0; off < memsz; off += PGSIZE) {
         if (off >= filesz) {
-            if ((err = sys_exec_config_page_alloc(0, (void *)va + off, perm))) {
+            if ((err = pagebatch_exec_alloc(&pb, 0, (void *)va + off, perm))) {
                 return err;
             }
             continue;
@@ -49,14 +51,18 @@ map_segment(uintptr_t va, size_t memsz,
         if (((count = readn(fd, (void *)UTEMP, MIN(PGSIZE, filesz - off)) < 0))) {
             return count;
         }
-        if ((err = sys_exec_config_page_map(0, (void *)UTEMP, 0, (void *)va + off, perm))) {
+        // UTEMP is reused for the next page, so submit now
+        if ((err = pagebatch_exec_map(&pb, 0, (void *)UTEMP, 0, (void *)va + off, perm))) {
             return err;
         }
-        if ((err = sys_page_unmap(0, (void *)UTEMP))) {
+        if ((err = pagebatch_unmap(&pb, 0, (void *)UTEMP))) {
+            return err;
+        }
+        if ((err = pagebatch_flush(&pb))) {
             return err;
         }
 	}
-	return 0;
+	return pagebatch_flush(&pb);
 }
 
 // Set up the initial stack for the new program image 
@@ -180,22 +186,35 @@ exec(const char *path, const char **argv)
 
     // map the shared page
     // done after the fd is closed
+    struct PageBatch pb;
+    pagebatch_init(&pb);
     for (size_t pdx = 0; pdx < PDX(UTOP); pdx++) {
         volatile pde_t *pde = &uvpd[pdx];
         if (!(*pde & PTE_P)) {
             continue;
         }
+        if (*pde & PTE_PS) {
+            void *va = PGADDR(pdx, 0, 0);
+            int perm = *pde & (PTE_SYSCALL | PTE_PS);
+            if ((perm & PTE_SHARE) && (err = pagebatch_exec_map(&pb, 0, va, 0, va, perm))) {
+                return err;
+            }
+            continue;
+        }
         for (size_t ptx = 0; ptx < NPTENTRIES; ptx++) {
             size_t pn = pdx * NPTENTRIES + ptx;
             void *va = (void *)(pn * PGSIZE);
             volatile pte_t *pte = &uvpt[pn];
             if (*pte & PTE_SHARE) {
-                if ((err = sys_exec_config_page_map(0, va, 0, va, *pte & PTE_SYSCALL))) {
+                if ((err = pagebatch_exec_map(&pb, 0, va, 0, va, *pte & PTE_SYSCALL))) {
                     return err;
                 }
             }
         }
     }
+    if ((err = pagebatch_flush(&pb))) {
+        return err;
+    }
 
 
     uintptr_t sp;
@@ -1,31 +1,142 @@
 #include <inc/fs.h>
 #include <inc/string.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+static envid_t fsenv;
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
 // type: request code, passed as the simple integer IPC value.
+// pg: the request page, or an IPC page range (see IPC_RANGE).
 // dstva: virtual address at which to receive reply page, 0 if none.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipc_page(unsigned type, void *pg, void *dstva)
 {
-	static envid_t fsenv;
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type,
+			*(uint32_t *) IPC_RANGE_VA(pg));
+
+	return ipc_call(fsenv, type, pg, PTE_P | PTE_W | PTE_U, dstva, NULL);
+}
+
+static int
+fsipc(unsigned type, void *dstva)
+{
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
+	return fsipc_page(type, &fsipcbuf, dstva);
+}
+
+// Request ring shared with the file server (see struct Fsring).  It is
+// set up by the first request that can use it.  A child inherits its
+// parent's ring through PTE_SHARE, sees that it is not the owner, and
+// sets up its own in its place.
+#define FSRINGVA	0xCF000000
+
+static struct Fsring *fsring = (struct Fsring *) FSRINGVA;
+static union Fsipc *fsring_slots = (union Fsipc *) (FSRINGVA + PGSIZE);
+static uint32_t fsring_sq_tail;		// Requests posted
+static uint32_t fsring_cq_head;		// Completions consumed
+static envid_t fsring_failed;		// Environment that could not set one up
+
+// Return true if this environment has a request ring, setting one up
+// if necessary.  Otherwise requests go through fsipc.
+static bool
+fsring_ready(void)
+{
+	int i, r;
+	char *va;
+
+	if ((uvpd[PDX(fsring)] & PTE_P) && (uvpt[PGNUM(fsring)] & PTE_P)
+	    && fsring->r_owner == thisenv->env_id)
+		return true;
+	if (fsring_failed == thisenv->env_id)
+		return false;
+
+	// Fresh pages, replacing any ring inherited from our parent
+	for (i = 0; i < FSRING_NPAGES; i++) {
+		va = (char *) fsring + i * PGSIZE;
+		if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			goto fail;
+	}
+	if ((r = fsipc_page(FSREQ_RING_SETUP,
+			    IPC_RANGE(fsring, FSRING_NPAGES), NULL)) < 0)
+		goto fail;
+	fsring_sq_tail = fsring_cq_head = 0;
+	fsring->r_owner = thisenv->env_id;
+	return true;
+
+fail:
 	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+		cprintf("[%08x] fsring setup: %e\n", thisenv->env_id, r);
+	fsring_failed = thisenv->env_id;
+	return false;
+}
+
+// The slot in which to fill in the next request.
+static union Fsipc *
+fsring_next(void)
+{
+	return &fsring_slots[fsring_sq_tail % FSRING_NENT];
+}
+
+// Add the request in fsring_next() with request code 'type' to the
+// batch that fsring_doorbell publishes.  At most FSRING_NENT requests
+// may be outstanding.
+static void
+fsring_post(unsigned type)
+{
+	assert(fsring_sq_tail - fsring_cq_head < FSRING_NENT);
+	fsring->r_sq[fsring_sq_tail % FSRING_NENT] = type;
+	fsring_sq_tail++;
+}
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+// Publish the requests posted since last time as one batch, and wake
+// the server if it went to sleep so that it sees them.  The xchg orders
+// our r_sq_tail store before the r_idle load.
+static void
+fsring_doorbell(void)
+{
+	// x86 does not reorder stores: the slots are visible before the tail
+	__asm __volatile("" : : : "memory");
+	fsring->r_sq_tail = fsring_sq_tail;
+	if (xchg(&fsring->r_idle, 0))
+		ipc_send(fsenv, FSREQ_RING_DOORBELL, NULL, 0);
+}
+
+// Wait for the oldest outstanding request to complete, and return its
+// result and, in *slot_store, its slot.
+static int
+fsring_complete(union Fsipc **slot_store)
+{
+	uint32_t seq = fsring_cq_head, tail;
+
+	while ((int32_t) (fsring->r_cq_tail - seq) <= 0) {
+		// Tell the server to wake us, then look again in case it
+		// completed the request before it could see r_waiting
+		fsring->r_waiting = 1;
+		__sync_synchronize();
+		tail = fsring->r_cq_tail;
+		if ((int32_t) (tail - seq) > 0)
+			break;
+		sys_wait_on((void *) &fsring->r_cq_tail, tail, 0);
+	}
+	// Nor does it reorder loads, but the compiler might: read the
+	// result only after seeing the tail that covers it.
+	__asm __volatile("" : : : "memory");
+	fsring_cq_head++;
+	*slot_store = &fsring_slots[seq % FSRING_NENT];
+	return fsring->r_cq[seq % FSRING_NENT];
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -33,6 +144,8 @@ static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
 static int devfile_trunc(struct Fd *fd, off_t newsize);
+static ssize_t devfile_read_ring(struct Fd *fd, void *buf, size_t n);
+static ssize_t devfile_write_ring(struct Fd *fd, const void *buf, size_t n);
 
 struct Dev devfile =
 {
@@ -117,6 +230,9 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	if (n > PGSIZE && fsring_ready())
+		return devfile_read_ring(fd, buf, n);
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -127,6 +243,49 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	return r;
 }
 
+// Read more than a page by posting up to FSRING_NENT page-sized read
+// requests on the ring at once.  The server serves them in order, so
+// the bytes come back in order; a short read means end of file.
+// If the read stops early, the requests after it may still have moved
+// the file offset, so put it back after the bytes we return.
+static ssize_t
+devfile_read_ring(struct Fd *fd, void *buf, size_t n)
+{
+	union Fsipc *slot;
+	size_t want[FSRING_NENT];
+	off_t start = fd->fd_offset;
+	ssize_t total = 0;
+	int i, nreq, r, err = 0;
+	bool done = false;
+
+	for (nreq = 0; nreq < FSRING_NENT && nreq * PGSIZE < n; nreq++) {
+		want[nreq] = MIN(n - nreq * PGSIZE, PGSIZE);
+		slot = fsring_next();
+		slot->read.req_fileid = fd->fd_file.id;
+		slot->read.req_n = want[nreq];
+		fsring_post(FSREQ_READ);
+	}
+	fsring_doorbell();
+
+	for (i = 0; i < nreq; i++) {
+		r = fsring_complete(&slot);
+		if (done)
+			continue;
+		if (r < 0) {
+			err = r;
+			done = true;
+			continue;
+		}
+		assert(r <= want[i]);
+		memmove((char *) buf + total, slot->readRet.ret_buf, r);
+		total += r;
+		done = (r < want[i]);
+	}
+	if (done)
+		fd->fd_offset = start + total;
+	return total > 0 ? total : err;
+}
+
 
 // Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
 //
@@ -141,6 +300,9 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// remember that write is always allowed to write *fewer*
 	// bytes than requested.
 	// LAB 5: Your code here
+    if (n > sizeof(fsipcbuf.write.req_buf) && fsring_ready()) {
+        return devfile_write_ring(fd, buf, n);
+    }
     if (n > sizeof(fsipcbuf.write.req_buf)) {
         n = sizeof(fsipcbuf.write.req_buf);
     }
@@ -155,6 +317,50 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	return r;
 }
 
+// Write more than fits in one request by posting up to FSRING_NENT
+// write requests on the ring at once.  The server skips the writes
+// after a failed one; as in devfile_read_ring, a write that stops early
+// leaves the file offset after the bytes written.
+static ssize_t
+devfile_write_ring(struct Fd *fd, const void *buf, size_t n)
+{
+	union Fsipc *slot;
+	const size_t max = sizeof(slot->write.req_buf);
+	size_t want[FSRING_NENT];
+	off_t start = fd->fd_offset;
+	ssize_t total = 0;
+	int i, nreq, r, err = 0;
+	bool done = false;
+
+	for (nreq = 0; nreq < FSRING_NENT && nreq * max < n; nreq++) {
+		want[nreq] = MIN(n - nreq * max, max);
+		slot = fsring_next();
+		slot->write.req_fileid = fd->fd_file.id;
+		slot->write.req_n = want[nreq];
+		memmove(slot->write.req_buf, (const char *) buf + nreq * max,
+			want[nreq]);
+		fsring_post(FSREQ_WRITE);
+	}
+	fsring_doorbell();
+
+	for (i = 0; i < nreq; i++) {
+		r = fsring_complete(&slot);
+		if (done)
+			continue;
+		if (r < 0) {
+			err = r;
+			done = true;
+			continue;
+		}
+		assert(r <= want[i]);
+		total += r;
+		done = (r < want[i]);
+	}
+	if (done)
+		fd->fd_offset = start + total;
+	return total > 0 ? total : err;
+}
+
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
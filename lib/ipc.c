@@ -4,7 +4,9 @@
 
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
-//	that address.
+//	that address.  'pg' may be an IPC page range (see IPC_RANGE) to
+//	accept a grant of several pages; thisenv->env_ipc_npages says
+//	how many arrived.
 // If 'from_env_store' is nonnull, then store the IPC sender's envid in
 //	*from_env_store.
 // If 'perm_store' is nonnull, then store the IPC sender's page permission
@@ -46,12 +48,36 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	return thisenv->env_ipc_value;
 }
 
+// Turn 'pg', which may be an IPC page range, into the page-aligned
+// srcva the send system calls take, adding its page count to *perm.
+static void *
+ipc_srcva(void *pg, int *perm)
+{
+    if (pg == NULL) {
+        return (void *)0xffffffff;
+    }
+    *perm |= IPC_PERM_NPAGES(IPC_RANGE_NPAGES(pg));
+    return IPC_RANGE_VA(pg);
+}
+
+// Sleep until 'to_env', whose queue was full, may have room again:
+// until its env_ipc_seq moves on from 'seq', read before the failed send.
+static void
+ipc_wait_room(envid_t to_env, uint32_t seq)
+{
+    sys_wait_on((void *)&envs[ENVX(to_env)].env_ipc_seq, seq, 0);
+}
+
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
+// 'pg' may be an IPC page range, granting all its pages at once.
 // This function keeps trying until it succeeds.
 // It should panic() on any error other than -E_IPC_NOT_RECV.
 //
+// A receiver that is not receiving gets the message queued by the
+// kernel.  While its queue is full, sleep on its env_ipc_seq word;
+// sys_ipc_recv bumps it and wakes us up.
+//
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
 //   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
@@ -59,13 +85,12 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
 	// LAB 4: Your code here.
     int err;
-    void *srcva = (void *)0xffffffff;
-    if (pg != NULL) {
-        srcva = pg;
-    }
+    void *srcva = ipc_srcva(pg, &perm);
+    uint32_t seq = envs[ENVX(to_env)].env_ipc_seq;
 
     while ((err = sys_ipc_try_send(to_env, val, srcva, perm)) == -E_IPC_NOT_RECV) {
-        sys_yield();
+        ipc_wait_room(to_env, seq);
+        seq = envs[ENVX(to_env)].env_ipc_seq;
     }
 
     if (err) {
@@ -73,6 +98,76 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
     }
 }
 
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv' like
+// ipc_send, then wait for the reply like ipc_recv(NULL, rcv_pg,
+// perm_store) and return its value.  Both happen in one system call,
+// which runs 'toenv' right away instead of waiting for the scheduler.
+// Panics on any send error other than -E_IPC_NOT_RECV, and on a receive
+// error, which may come after the request was sent.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+    int err;
+    void *srcva = ipc_srcva(pg, &perm);
+    uint32_t seq = envs[ENVX(to_env)].env_ipc_seq;
+    void *dstva = (void *)0xffffffff;
+    if (rcv_pg != NULL) {
+        dstva = rcv_pg;
+    }
+
+    while ((err = sys_ipc_call(to_env, val, srcva, perm, dstva)) == -E_IPC_NOT_RECV) {
+        ipc_wait_room(to_env, seq);
+        seq = envs[ENVX(to_env)].env_ipc_seq;
+    }
+
+    if (err) {
+        panic("ipc_call: %e", err);
+    }
+    if (perm_store != NULL) {
+        *perm_store = thisenv->env_ipc_perm;
+    }
+    return thisenv->env_ipc_value;
+}
+
+// For servers answering ipc_call: send the reply 'val' (and 'pg' with
+// 'perm', if 'pg' is nonnull) to 'to_env', unless it is 0, then receive
+// the next request as ipc_recv(from_env_store, rcv_pg, perm_store) would.
+// Like ipc_send, wait for 'to_env' to be receiving if it is not yet; a
+// reply to an environment that is gone is dropped.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+    int err;
+    int rperm = 0;
+    envid_t from_env = 0;
+    void *srcva = ipc_srcva(pg, &perm);
+    uint32_t seq = envs[ENVX(to_env)].env_ipc_seq;
+    void *dstva = (void *)0xffffffff;
+    if (rcv_pg != NULL) {
+        dstva = rcv_pg;
+    }
+    while ((err = sys_ipc_reply_wait(to_env, val, srcva, perm, dstva)) == -E_IPC_NOT_RECV) {
+        ipc_wait_room(to_env, seq);
+        seq = envs[ENVX(to_env)].env_ipc_seq;
+    }
+    if (err == 0) {
+        from_env = thisenv->env_ipc_from;
+        rperm = thisenv->env_ipc_perm;
+    }
+    if (from_env_store != NULL) {
+        *from_env_store = from_env;
+    }
+    if (perm_store != NULL) {
+        *perm_store = rperm;
+    }
+    if (err) {
+        return err;
+    }
+    return thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
@@ -0,0 +1,58 @@
+// Printing kernel latency statistics, for the kernel monitor's
+// "kstats" command and for user/kstats.
+
+#include <inc/kstats.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+
+static void
+kstats_print_hist(const char *kind, int num, struct KstatHist *kh)
+{
+	int i;
+
+	cprintf("%-8s%4d%10u%10llu%12llu ", kind, num, kh->kh_count,
+		kh->kh_cycles / kh->kh_count, kh->kh_max);
+	for (i = 0; i < KSTAT_NBUCKET; i++)
+		if (kh->kh_bucket[i])
+			cprintf(" %d:%u", i, kh->kh_bucket[i]);
+	cprintf("\n");
+}
+
+// Sum src into dst.
+static void
+kstats_add(struct KstatHist *dst, const volatile struct KstatHist *src)
+{
+	int i;
+
+	dst->kh_count += src->kh_count;
+	dst->kh_cycles += src->kh_cycles;
+	if (src->kh_max > dst->kh_max)
+		dst->kh_max = src->kh_max;
+	for (i = 0; i < KSTAT_NBUCKET; i++)
+		dst->kh_bucket[i] += src->kh_bucket[i];
+}
+
+// Print the traps and system calls counted in ks[0] to ks[ncpu - 1],
+// summed over the CPUs: how many, their average and longest time in
+// cycles, and each non-empty histogram bucket as log2(cycles):count.
+void
+kstats_print(const volatile struct Kstats *ks, int ncpu)
+{
+	struct KstatHist sum;
+	int cpu, i;
+
+	cprintf("%-12s%10s%10s%12s  %s\n", "event", "count", "avg", "max",
+		"log2(cycles):count");
+	for (i = 0; i < KSTAT_NTRAP + KSTAT_NSYSCALL; i++) {
+		memset(&sum, 0, sizeof(sum));
+		for (cpu = 0; cpu < ncpu; cpu++)
+			kstats_add(&sum, i < KSTAT_NTRAP ? &ks[cpu].ks_trap[i] :
+				   &ks[cpu].ks_syscall[i - KSTAT_NTRAP]);
+		if (sum.kh_count == 0)
+			continue;
+		if (i < KSTAT_NTRAP)
+			kstats_print_hist("trap", i, &sum);
+		else
+			kstats_print_hist("syscall", i - KSTAT_NTRAP, &sum);
+	}
+}
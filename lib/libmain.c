@@ -6,6 +6,7 @@
 extern void umain(int argc, char **argv);
 
 const volatile struct Env *thisenv;
+const volatile struct Kstats *kstats = (const volatile struct Kstats *) UKSTATS;
 const char *binaryname = "<unknown>";
 
 void
@@ -21,6 +22,9 @@ libmain(int argc, char **argv)
         }
     }
 
+	// pick the SSE2 memcpy and friends if the CPU has them
+	string_init();
+
 	// save the name of the program so that panic() can use it
 	if (argc > 0)
 		binaryname = argv[0];
@@ -41,10 +41,11 @@ isfree(void *v, size_t n)
 void*
 malloc(size_t n)
 {
-	int i, cont;
+	int i, cont, r;
 	int nwrap;
 	uint32_t *ref;
 	void *v;
+	struct PageBatch pb;
 
 	if (mptr == 0)
 		mptr = mbegin;
@@ -95,13 +96,20 @@ malloc(size_t n)
 	/*
 	 * allocate at mptr - the +4 makes sure we allocate a ref count.
 	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
+	pagebatch_init(&pb);
+	for (i = 0, r = 0; i < n + 4 && r >= 0; i += PGSIZE){
 		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
-		}
+		r = pagebatch_alloc(&pb, 0, mptr + i, PTE_P|PTE_U|PTE_W|cont);
+	}
+	if (r >= 0)
+		r = pagebatch_flush(&pb);
+	if (r < 0) {
+		/* undo whatever part of the run got mapped */
+		pagebatch_init(&pb);
+		for (i = 0; i < n + 4; i += PGSIZE)
+			pagebatch_unmap(&pb, 0, mptr + i);
+		pagebatch_flush(&pb);
+		return 0;	/* out of physical memory */
 	}
 
 	ref = (uint32_t*) (mptr + i - 4);
@@ -116,6 +124,7 @@ free(void *v)
 {
 	uint8_t *c;
 	uint32_t *ref;
+	struct PageBatch pb;
 
 	if (v == 0)
 		return;
@@ -123,8 +132,9 @@ free(void *v)
 
 	c = ROUNDDOWN(v, PGSIZE);
 
+	pagebatch_init(&pb);
 	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
+		pagebatch_unmap(&pb, 0, c);
 		c += PGSIZE;
 		assert(mbegin <= c && c < mend);
 	}
@@ -135,6 +145,7 @@ free(void *v)
 	 */
 	ref = (uint32_t*) (c + PGSIZE - 4);
 	if (--(*ref) == 0)
-		sys_page_unmap(0, c);
+		pagebatch_unmap(&pb, 0, c);
+	pagebatch_flush(&pb);
 }
 
@@ -12,21 +12,27 @@ union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 // The request body should be in nsipcbuf, and parts of the response
 // may be written back to nsipcbuf.
 // type: request code, passed as the simple integer IPC value.
+// pg: the request page, or an IPC page range (see IPC_RANGE).
 // Returns 0 if successful, < 0 on failure.
 static int
-nsipc(unsigned type)
+nsipc_page(unsigned type, void *pg)
 {
 	static envid_t nsenv;
 	if (nsenv == 0)
 		nsenv = ipc_find_env(ENV_TYPE_NS);
 
-	static_assert(sizeof(nsipcbuf) == PGSIZE);
-
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	return ipc_call(nsenv, type, pg, PTE_P|PTE_W|PTE_U, NULL, NULL);
+}
+
+static int
+nsipc(unsigned type)
+{
+	static_assert(sizeof(nsipcbuf) == PGSIZE);
+
+	return nsipc_page(type, &nsipcbuf);
 }
 
 int
@@ -102,15 +108,41 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 	return r;
 }
 
+// Sends too big for nsipcbuf are built here and granted to the network
+// server as a range of pages, which are allocated on first use.
+#define NSSENDVA	0xCE000000
+
+static struct Nsreq_send *nssend = (struct Nsreq_send *) NSSENDVA;
+
+// Send up to NSIPC_MAXSEND bytes in one request; returns the number
+// sent, which may be short, like write.
 int
 nsipc_send(int s, const void *buf, int size, unsigned int flags)
 {
-	nsipcbuf.send.req_s = s;
-	assert(size < 1600);
-	memmove(&nsipcbuf.send.req_buf, buf, size);
-	nsipcbuf.send.req_size = size;
-	nsipcbuf.send.req_flags = flags;
-	return nsipc(NSREQ_SEND);
+	static bool nssend_ready;
+	int i, r, npages;
+
+	if (size <= (int) (PGSIZE - sizeof(struct Nsreq_send))) {
+		nsipcbuf.send.req_s = s;
+		memmove(&nsipcbuf.send.req_buf, buf, size);
+		nsipcbuf.send.req_size = size;
+		nsipcbuf.send.req_flags = flags;
+		return nsipc(NSREQ_SEND);
+	}
+
+	for (i = 0; !nssend_ready && i < NSIPC_NPAGES; i++)
+		if ((r = sys_page_alloc(0, (char *) nssend + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	nssend_ready = true;
+
+	size = MIN(size, (int) NSIPC_MAXSEND);
+	nssend->req_s = s;
+	memmove(&nssend->req_buf, buf, size);
+	nssend->req_size = size;
+	nssend->req_flags = flags;
+	npages = ROUNDUP(sizeof(struct Nsreq_send) + size, PGSIZE) / PGSIZE;
+	return nsipc_page(NSREQ_SEND, IPC_RANGE(nssend, npages));
 }
 
 int
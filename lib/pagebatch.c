@@ -0,0 +1,79 @@
+// Queue page-mapping operations and submit them to the kernel in one
+// sys_page_batch call instead of one system call per page.
+
+#include <inc/lib.h>
+
+void
+pagebatch_init(struct PageBatch *pb)
+{
+	pb->pb_n = 0;
+}
+
+// Submit the queued operations.  On error, operations before the one
+// that failed have been done and the rest are dropped.
+int
+pagebatch_flush(struct PageBatch *pb)
+{
+	int r;
+
+	if (pb->pb_n == 0)
+		return 0;
+	r = sys_page_batch(pb->pb_ops, pb->pb_n);
+	pb->pb_n = 0;
+	return r;
+}
+
+static int
+pagebatch_add(struct PageBatch *pb, int op, envid_t srcenv, void *srcva,
+	      envid_t dstenv, void *dstva, int perm)
+{
+	int r;
+	struct PageOp *o;
+
+	if (pb->pb_n == PAGEBATCH_MAX && (r = pagebatch_flush(pb)) < 0)
+		return r;
+	o = &pb->pb_ops[pb->pb_n++];
+	o->op = op;
+	o->srcenv = srcenv;
+	o->srcva = srcva;
+	o->dstenv = dstenv;
+	o->dstva = dstva;
+	o->perm = perm;
+	return 0;
+}
+
+// The following queue one operation each, flushing first if the batch is
+// full; they return the error of that flush, if any.
+
+int
+pagebatch_alloc(struct PageBatch *pb, envid_t envid, void *va, int perm)
+{
+	return pagebatch_add(pb, PAGEOP_ALLOC, 0, 0, envid, va, perm);
+}
+
+int
+pagebatch_map(struct PageBatch *pb, envid_t srcenv, void *srcva,
+	      envid_t dstenv, void *dstva, int perm)
+{
+	return pagebatch_add(pb, PAGEOP_MAP, srcenv, srcva, dstenv, dstva, perm);
+}
+
+int
+pagebatch_unmap(struct PageBatch *pb, envid_t envid, void *va)
+{
+	return pagebatch_add(pb, PAGEOP_UNMAP, 0, 0, envid, va, 0);
+}
+
+int
+pagebatch_exec_alloc(struct PageBatch *pb, envid_t envid, void *va, int perm)
+{
+	return pagebatch_add(pb, PAGEOP_EXEC_ALLOC, 0, 0, envid, va, perm);
+}
+
+int
+pagebatch_exec_map(struct PageBatch *pb, envid_t srcenv, void *srcva,
+		   envid_t dstenv, void *dstva, int perm)
+{
+	return pagebatch_add(pb, PAGEOP_EXEC_MAP, srcenv, srcva,
+			     dstenv, dstva, perm);
+}
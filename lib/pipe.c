@@ -1,4 +1,5 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
@@ -19,12 +20,37 @@ struct Dev devpipe =
 
 #define PIPEBUFSIZ 32		// small to provoke races
 
+// How long a blocked reader or writer sleeps before checking whether
+// the other end went away without closing the pipe (e.g. it faulted).
+#define PIPEWAITMSEC 10
+
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	uint32_t p_rwait;	// a reader may be sleeping on p_wpos
+	uint32_t p_wwait;	// a writer may be sleeping on p_rpos
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
+// Wake everyone sleeping on *pos, if anyone announced they might be.
+static void
+pipe_wake(volatile uint32_t *waiting, off_t *pos)
+{
+	if (xchg(waiting, 0))
+		sys_wake(pos, NENV);
+}
+
+// Sleep until *pos moves away from 'seen'.  Announce ourselves first
+// (xchg is a full barrier), so a peer that moves *pos after our check
+// either sees the announcement or makes sys_wait_on fail with -E_AGAIN.
+static void
+pipe_sleep(volatile uint32_t *waiting, off_t *pos, off_t seen)
+{
+	xchg(waiting, 1);
+	if (*(volatile off_t *) pos == seen)
+		sys_wait_on(pos, seen, PIPEWAITMSEC);
+}
+
 int
 pipe(int pfd[2])
 {
@@ -119,20 +145,23 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
-				return i;
+				goto out;
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer moves wpos
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read sleep\n");
+			pipe_sleep(&p->p_rwait, &p->p_wpos, p->p_rpos);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+    out:
+	// we made room; let blocked writers continue
+	pipe_wake(&p->p_wwait, &p->p_rpos);
 	return i;
 }
 
@@ -157,10 +186,12 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let readers drain what we wrote so far,
+			// then sleep until one of them moves rpos
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write sleep\n");
+			pipe_wake(&p->p_rwait, &p->p_wpos);
+			pipe_sleep(&p->p_wwait, &p->p_rpos, p->p_wpos - PIPEBUFSIZ);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -168,6 +199,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wake(&p->p_rwait, &p->p_wpos);
 	return i;
 }
 
@@ -185,7 +217,12 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+
 	(void) sys_page_unmap(0, fd);
+	// whoever is blocked on the other end should notice the close now
+	pipe_wake(&p->p_rwait, &p->p_wpos);
+	pipe_wake(&p->p_wwait, &p->p_rpos);
 	return sys_page_unmap(0, fd2data(fd));
 }
 
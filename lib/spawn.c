@@ -266,6 +266,7 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 {
 	int i, r;
 	void *blk;
+	struct PageBatch pb;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -276,10 +277,11 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
+	pagebatch_init(&pb);
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
 			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
+			if ((r = pagebatch_alloc(&pb, child, (void*) (va + i), perm)) < 0)
 				return r;
 		} else {
 			// from file
@@ -289,12 +291,14 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 				return r;
 			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
 				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
+			// UTEMP is reused for the next page, so submit now
+			if ((r = pagebatch_map(&pb, 0, UTEMP, child, (void*) (va + i), perm)) < 0
+			    || (r = pagebatch_unmap(&pb, 0, UTEMP)) < 0
+			    || (r = pagebatch_flush(&pb)) < 0)
 				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
 		}
 	}
-	return 0;
+	return pagebatch_flush(&pb);
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -303,23 +307,33 @@ copy_shared_pages(envid_t child)
 {
 	// LAB 5: Your code here.
     int err;
+    struct PageBatch pb;
+    pagebatch_init(&pb);
     for (size_t pdx = 0; pdx < PDX(UTOP); pdx++) {
         volatile pde_t *pde = &uvpd[pdx];
         if (!(*pde & PTE_P)) {
             continue;
         }
+        if (*pde & PTE_PS) {
+            void *va = PGADDR(pdx, 0, 0);
+            int perm = *pde & (PTE_SYSCALL | PTE_PS);
+            if ((perm & PTE_SHARE) && (err = pagebatch_map(&pb, 0, va, child, va, perm))) {
+                return err;
+            }
+            continue;
+        }
         for (size_t ptx = 0; ptx < NPTENTRIES; ptx++) {
             size_t pn = pdx * NPTENTRIES + ptx;
             volatile pte_t *pte = &uvpt[pn];
             int perm = *pte & PTE_SYSCALL;
             if (perm & PTE_SHARE) {
                 void *va = (void *)(pn * PGSIZE);
-                if ((err = sys_page_map(0, va, child, va, perm))) {
+                if ((err = pagebatch_map(&pb, 0, va, child, va, perm))) {
                     return err;
                 }
             }
         }
     }
-	return 0;
+	return pagebatch_flush(&pb);
 }
 
@@ -1,6 +1,7 @@
 // Basic string routines.  Not hardware optimized, but not shabby.
 
 #include <inc/string.h>
+#include <inc/x86.h>
 
 // Using assembly for memset/memmove
 // makes some difference on real hardware,
@@ -118,11 +119,9 @@ strfind(const char *s, char c)
 }
 
 #if ASM
-void *
-memset(void *v, int c, size_t n)
+static void *
+memset_rep(void *v, int c, size_t n)
 {
-	char *p;
-
 	if (n == 0)
 		return v;
 	if ((int)v%4 == 0 && n%4 == 0) {
@@ -138,8 +137,8 @@ memset(void *v, int c, size_t n)
 	return v;
 }
 
-void *
-memmove(void *dst, const void *src, size_t n)
+static void *
+memmove_rep(void *dst, const void *src, size_t n)
 {
 	const char *s;
 	char *d;
@@ -168,6 +167,162 @@ memmove(void *dst, const void *src, size_t n)
 	return dst;
 }
 
+#ifndef JOS_KERNEL
+// User environments copy and fill anything but short buffers with
+// SSE2, in 64-byte blocks through %xmm0-%xmm3 once the destination is
+// 16-byte aligned.  From a page up, the stores bypass the cache.  The
+// kernel keeps rep movs: it never saves its own FPU registers (see
+// kern/fpu.c).  _pgfault_upcall saves %xmm0-%xmm3 around the handler,
+// since a fault can land between a block's loads and its stores.
+#define MEM_SSE_MIN	128	// Below this, rep movs/stos wins
+#define MEM_NT_MIN	4096	// Use non-temporal stores from here up
+
+// Whether the CPU has SSE2, set at startup by string_init.
+int string_sse2;
+
+void
+string_init(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	string_sse2 = (edx & CPUID_EDX_SSE2) != 0;
+}
+
+#define SSE_LOAD64(src) \
+	"movdqu   (" src "), %%xmm0\n\t" \
+	"movdqu 16(" src "), %%xmm1\n\t" \
+	"movdqu 32(" src "), %%xmm2\n\t" \
+	"movdqu 48(" src "), %%xmm3\n\t"
+#define SSE_FILL64(op, dst) \
+	op " %%xmm0,   (" dst ")\n\t" \
+	op " %%xmm0, 16(" dst ")\n\t" \
+	op " %%xmm0, 32(" dst ")\n\t" \
+	op " %%xmm0, 48(" dst ")\n\t"
+#define SSE_STORE64(op, dst) \
+	op " %%xmm0,   (" dst ")\n\t" \
+	op " %%xmm1, 16(" dst ")\n\t" \
+	op " %%xmm2, 32(" dst ")\n\t" \
+	op " %%xmm3, 48(" dst ")\n\t"
+
+// Copy n >= MEM_SSE_MIN bytes forward.  Also right for overlapping
+// buffers with dst below src: every block is loaded before any store
+// can reach it.
+static void * __attribute__((target("sse2")))
+memcpy_sse2(void *dst, const void *src, size_t n)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t head = -(uintptr_t) d & 15;
+
+	n -= head;
+	asm volatile("cld; rep movsb"
+		     : "+D" (d), "+S" (s), "+c" (head) : : "cc", "memory");
+	if (n >= MEM_NT_MIN) {
+		for (; n >= 64; n -= 64, s += 64, d += 64)
+			asm volatile(SSE_LOAD64("%1") SSE_STORE64("movntdq", "%0")
+				     : : "r" (d), "r" (s)
+				     : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+		// Non-temporal stores are weakly ordered
+		asm volatile("sfence" ::: "memory");
+	} else {
+		for (; n >= 64; n -= 64, s += 64, d += 64)
+			asm volatile(SSE_LOAD64("%1") SSE_STORE64("movdqa", "%0")
+				     : : "r" (d), "r" (s)
+				     : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+	}
+	asm volatile("cld; rep movsb"
+		     : "+D" (d), "+S" (s), "+c" (n) : : "cc", "memory");
+	return dst;
+}
+
+// Copy n >= MEM_SSE_MIN bytes backward, for overlapping buffers with
+// dst above src.
+static void * __attribute__((target("sse2")))
+memmove_back_sse2(void *dst, const void *src, size_t n)
+{
+	char *d = (char *) dst + n;
+	const char *s = (const char *) src + n;
+
+	for (; (uintptr_t) d & 15; n--)
+		*--d = *--s;
+	for (; n >= 64; n -= 64) {
+		s -= 64;
+		d -= 64;
+		asm volatile(SSE_LOAD64("%1") SSE_STORE64("movdqa", "%0")
+			     : : "r" (d), "r" (s)
+			     : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+	}
+	while (n-- > 0)
+		*--d = *--s;
+	return dst;
+}
+
+static void * __attribute__((target("sse2")))
+memset_sse2(void *v, int c, size_t n)
+{
+	char *p = v;
+	size_t head = -(uintptr_t) p & 15;
+	uint32_t pat[4];
+
+	c &= 0xFF;
+	pat[0] = pat[1] = pat[2] = pat[3] = c * 0x01010101;
+	n -= head;
+	asm volatile("cld; rep stosb"
+		     : "+D" (p), "+c" (head) : "a" (c) : "cc", "memory");
+	if (n >= MEM_NT_MIN) {
+		for (; n >= 64; n -= 64, p += 64)
+			asm volatile("movdqu %1, %%xmm0\n\t"
+				     SSE_FILL64("movntdq", "%0")
+				     : : "r" (p), "m" (pat) : "memory", "xmm0");
+		asm volatile("sfence" ::: "memory");
+	} else {
+		for (; n >= 64; n -= 64, p += 64)
+			asm volatile("movdqu %1, %%xmm0\n\t"
+				     SSE_FILL64("movdqa", "%0")
+				     : : "r" (p), "m" (pat) : "memory", "xmm0");
+	}
+	asm volatile("cld; rep stosb"
+		     : "+D" (p), "+c" (n) : "a" (c) : "cc", "memory");
+	return v;
+}
+#endif
+
+void *
+memset(void *v, int c, size_t n)
+{
+#ifndef JOS_KERNEL
+	if (n >= MEM_SSE_MIN && string_sse2)
+		return memset_sse2(v, c, n);
+#endif
+	return memset_rep(v, c, n);
+}
+
+void *
+memmove(void *dst, const void *src, size_t n)
+{
+#ifndef JOS_KERNEL
+	if (n >= MEM_SSE_MIN && string_sse2) {
+		if ((const char *) src < (char *) dst &&
+		    (const char *) src + n > (char *) dst)
+			return memmove_back_sse2(dst, src, n);
+		return memcpy_sse2(dst, src, n);
+	}
+#endif
+	return memmove_rep(dst, src, n);
+}
+
+// Unlike memmove, memcpy never has to look for overlap.
+void *
+memcpy(void *dst, const void *src, size_t n)
+{
+#ifndef JOS_KERNEL
+	if (n >= MEM_SSE_MIN && string_sse2)
+		return memcpy_sse2(dst, src, n);
+#endif
+	return memmove_rep(dst, src, n);
+}
+
 #else
 
 void *
@@ -203,13 +358,13 @@ memmove(void *dst, const void *src, size_t n)
 
 	return dst;
 }
-#endif
 
 void *
 memcpy(void *dst, const void *src, size_t n)
 {
 	return memmove(dst, src, n);
 }
+#endif
 
 int
 memcmp(const void *v1, const void *v2, size_t n)
@@ -2,11 +2,22 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+// Whether to enter the kernel with sysenter, which the kernel sets up
+// whenever the CPU has it (see trap_init_percpu); -1 until we know.
+static int use_sysenter = -1;
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
+	uint32_t edx;
+
+	if (use_sysenter < 0) {
+		cpuid(1, NULL, NULL, NULL, &edx);
+		use_sysenter = (edx & CPUID_EDX_SEP) != 0;
+	}
 
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
@@ -19,17 +30,37 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// The last clause tells the assembler that this can
 	// potentially change the condition codes and arbitrary
 	// memory locations.
-
-	asm volatile("int %1\n"
-		     : "=a" (ret)
-		     : "i" (T_SYSCALL),
-		       "a" (num),
-		       "d" (a1),
-		       "c" (a2),
-		       "b" (a3),
-		       "D" (a4),
-		       "S" (a5)
-		     : "cc", "memory");
+	//
+	// sysenter saves nothing, so it takes the same registers plus
+	// our stack pointer in BP, with the return address on top of
+	// the stack.  sysexit comes back there with DX and CX lost.
+
+	if (use_sysenter)
+		asm volatile("pushl %%ebp\n"
+			     "\tpushl $1f\n"
+			     "\tmovl %%esp, %%ebp\n"
+			     "\tsysenter\n"
+			     "1:\taddl $4, %%esp\n"
+			     "\tpopl %%ebp\n"
+			     : "=a" (ret),
+			       "+d" (a1),
+			       "+c" (a2)
+			     : "a" (num),
+			       "b" (a3),
+			       "D" (a4),
+			       "S" (a5)
+			     : "cc", "memory");
+	else
+		asm volatile("int %1\n"
+			     : "=a" (ret)
+			     : "i" (T_SYSCALL),
+			       "a" (num),
+			       "d" (a1),
+			       "c" (a2),
+			       "b" (a3),
+			       "D" (a4),
+			       "S" (a5)
+			     : "cc", "memory");
 
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -87,12 +118,30 @@ sys_page_unmap(envid_t envid, void *va)
 
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
 	return syscall(SYS_env_set_status, 1, envid, status, 0, 0, 0);
 }
 
+int
+sys_env_set_sched(envid_t envid, int class, uint32_t weight)
+{
+	return syscall(SYS_env_set_sched, 1, envid, class, weight, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpumask, 0, 0, 0);
+}
+
 int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -157,6 +206,24 @@ sys_time_msec(void)
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
+int
+sys_wait_on(void *va, uint32_t expected, unsigned int timeout)
+{
+	return syscall(SYS_wait_on, 0, (uint32_t) va, expected, timeout, 0, 0);
+}
+
+int
+sys_wake(void *va, int n)
+{
+	return syscall(SYS_wake, 0, (uint32_t) va, n, 0, 0, 0);
+}
+
+int
+sys_sleep(unsigned int msec)
+{
+	return syscall(SYS_sleep, 0, msec, 0, 0, 0, 0);
+}
+
 
 int
 sys_transmit_packet(void *va, size_t n)
@@ -170,3 +237,21 @@ sys_recv_packet(void *va, size_t max_n)
 {
 	return syscall(SYS_recv_packet, 0, (uintptr_t)va, max_n, 0, 0, 0);
 }
+
+int
+sys_page_batch(const struct PageOp *ops, int n)
+{
+	return syscall(SYS_page_batch, 0, (uint32_t) ops, n, 0, 0, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
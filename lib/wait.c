@@ -1,13 +1,19 @@
 #include <inc/lib.h>
 
+// The kernel wakes sleepers on env_status when it frees an env.  Since
+// the slot may be freed and reused between our check and the sleep,
+// recheck every so often instead of trusting the wakeup alone.
+#define WAITMSEC 100
+
 // Waits until 'envid' exits.
 void
 wait(envid_t envid)
 {
 	const volatile struct Env *e;
+	unsigned status;
 
 	assert(envid != 0);
 	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	while (e->env_id == envid && (status = e->env_status) != ENV_FREE)
+		sys_wait_on((void *) &e->env_status, status, WAITMSEC);
 }
@@ -1,6 +1,11 @@
 #include <net/ns.h>
 #include <inc/memlayout.h>
 
+// The e1000 driver does not raise receive interrupts, so when the
+// receive ring is empty we sleep this many milliseconds and poll again
+// instead of spinning.
+#define INPUT_POLL_MSEC 10
+
 // see lib/nsipc.c
 extern union Nsipc nsipcbuf;
 
@@ -10,7 +15,6 @@ void
 input(envid_t ns_envid)
 {
 	binaryname = "ns_input";
-    sys_page_alloc(0, (void *)UTEMP, PTE_P | PTE_W | PTE_U);
 
 	// LAB 6: Your code here:
 	// 	- read a packet from the device driver
@@ -19,17 +23,18 @@ input(envid_t ns_envid)
 	// reading from it for a while, so don't immediately receive
 	// another packet in to the same physical page.
     while (1) {
-        // it is weird that !(nsipcbuf & PTE_W)
         struct jif_pkt *packet_buf = &nsipcbuf.pkt;
         ssize_t n;
-        while ((n = sys_recv_packet((void *)UTEMP, PGSIZE)) < 0)  {
-            sys_yield();
+        // Receive into a fresh page every time: the network server
+        // keeps reading the page we sent it last.
+        if ((n = sys_page_alloc(0, &nsipcbuf, PTE_P | PTE_W | PTE_U)) < 0) {
+            panic("input: sys_page_alloc: %e", n);
+        }
+        while ((n = sys_recv_packet(packet_buf->jp_data,
+                                    PGSIZE - sizeof(packet_buf->jp_len))) < 0) {
+            sys_sleep(INPUT_POLL_MSEC);
         }
-        memcpy(packet_buf->jp_data, (void *)UTEMP, n);
         packet_buf->jp_len = n;
         ipc_send(ns_envid, NSREQ_INPUT, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-        for (int i = 0; i < 5; i++) {
-            sys_yield();
-        }
     }
 }
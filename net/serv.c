@@ -64,7 +64,7 @@ get_buffer(void) {
 		return 0;
 	}
 
-	va = (void *)(REQVA + i * PGSIZE);
+	va = (void *)(REQVA + i * NSIPC_NPAGES * PGSIZE);
 	buse[i] = 1;
 
 	return va;
@@ -72,7 +72,7 @@ get_buffer(void) {
 
 static void
 put_buffer(void *va) {
-	int i = ((uint32_t)va - REQVA) / PGSIZE;
+	int i = ((uint32_t)va - REQVA) / (NSIPC_NPAGES * PGSIZE);
 	buse[i] = 0;
 }
 
@@ -181,6 +181,7 @@ struct st_args {
 	int32_t reqno;
 	uint32_t whom;
 	union Nsipc *req;
+	int npages;		// Pages granted at req
 };
 
 static void
@@ -250,7 +251,8 @@ serve_thread(uint32_t a) {
 		ipc_send(args->whom, r, 0, 0);
 
 	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
+	for (r = 0; r < args->npages; r++)
+		sys_page_unmap(0, (char *) args->req + r * PGSIZE);
 	free(args);
 }
 
@@ -270,7 +272,8 @@ serve(void) {
 
 		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		reqno = ipc_recv((int32_t *) &whom,
+				 IPC_RANGE(va, NSIPC_NPAGES), &perm);
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
@@ -297,6 +300,7 @@ serve(void) {
 		args->reqno = reqno;
 		args->whom = whom;
 		args->req = va;
+		args->npages = thisenv->env_ipc_npages;
 
 		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
 		thread_yield(); // let the thread created run
@@ -0,0 +1,37 @@
+// Time copy-on-write faults: write to each page of a region that a
+// fork has just made copy-on-write, FAULT_NPAGES pages per round.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define FAULT_NPAGES	256
+
+static uint64_t cycles[BENCH_MAXITERS];
+static char region[FAULT_NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+void
+umain(int argc, char **argv)
+{
+	int i, j, n = bench_iters(argc, argv, 1024);
+	envid_t child;
+	uint64_t t;
+
+	for (i = 0; i < n; i += FAULT_NPAGES) {
+		// Make every page present and writable, then share them
+		memset(region, i, sizeof(region));
+		if ((child = fork()) < 0)
+			panic("fork: %e", child);
+		if (child == 0)
+			return;
+		wait(child);
+
+		for (j = 0; j < FAULT_NPAGES && i + j < n; j++) {
+			t = read_tsc();
+			region[j * PGSIZE] = j;
+			cycles[i + j] = read_tsc() - t;
+		}
+	}
+	bench_report("cow_fault", cycles, n);
+
+	cprintf("bench: done\n");
+}
@@ -0,0 +1,41 @@
+// Time creating an environment and waiting for it to exit, with fork
+// and with spawn.  The spawned program is this one, told to exit.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+static uint64_t cycles[BENCH_MAXITERS];
+
+void
+umain(int argc, char **argv)
+{
+	int i, n;
+	envid_t child;
+	uint64_t t;
+
+	if (argc > 1 && strcmp(argv[1], "exit") == 0)
+		return;
+	n = bench_iters(argc, argv, 100);
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		if ((child = fork()) < 0)
+			panic("fork: %e", child);
+		if (child == 0)
+			exit();
+		wait(child);
+		cycles[i] = read_tsc() - t;
+	}
+	bench_report("fork_wait", cycles, n);
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		if ((child = spawnl("bench_fork", "bench_fork", "exit", 0)) < 0)
+			panic("spawn: %e", child);
+		wait(child);
+		cycles[i] = read_tsc() - t;
+	}
+	bench_report("spawn_wait", cycles, n);
+
+	cprintf("bench: done\n");
+}
@@ -0,0 +1,74 @@
+// Time IPC round trips to a child that echoes every message back:
+// with ipc_send and ipc_recv, with ipc_call, and with ipc_call moving
+// one page or a grant of GRANT_NPAGES pages along.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define GRANT_NPAGES	16
+#define STOP		0x7fffffff
+
+static uint64_t cycles[BENCH_MAXITERS];
+static char grant[GRANT_NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+echo(void)
+{
+	envid_t whom = 0;
+	int32_t v = 0;
+
+	while ((v = ipc_reply_wait(whom, v, NULL, 0, &whom,
+				   IPC_RANGE(UTEMP, GRANT_NPAGES), NULL)) != STOP)
+		if (v < 0)
+			panic("ipc_reply_wait: %e", v);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, n = bench_iters(argc, argv, 1000);
+	envid_t child;
+	uint64_t t;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		echo();
+		return;
+	}
+	memset(grant, 0, sizeof(grant));
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		ipc_send(child, i, NULL, 0);
+		ipc_recv(NULL, NULL, NULL);
+		cycles[i] = read_tsc() - t;
+	}
+	bench_report("ipc_sendrecv", cycles, n);
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		ipc_call(child, i, NULL, 0, NULL, NULL);
+		cycles[i] = read_tsc() - t;
+	}
+	bench_report("ipc_call", cycles, n);
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		ipc_call(child, i, grant, PTE_P|PTE_U|PTE_W, NULL, NULL);
+		cycles[i] = read_tsc() - t;
+	}
+	bench_report("ipc_page", cycles, n);
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		ipc_call(child, i, IPC_RANGE(grant, GRANT_NPAGES),
+			 PTE_P|PTE_U|PTE_W, NULL, NULL);
+		cycles[i] = read_tsc() - t;
+	}
+	bench_report("ipc_grant16", cycles, n);
+
+	ipc_send(child, STOP, NULL, 0);
+	wait(child);
+	cprintf("bench: done\n");
+}
@@ -0,0 +1,70 @@
+// Time memcpy, memmove and memset on buffers from 64 bytes to 64KB,
+// with the SSE2 routines and again with rep movs/stos alone (the
+// "_rep" results).  Divide the size by the median for bytes per cycle.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define MAXSIZE	65536
+
+static uint64_t cycles[BENCH_MAXITERS];
+static char src[MAXSIZE] __attribute__((aligned(PGSIZE)));
+static char dst[MAXSIZE + 64] __attribute__((aligned(PGSIZE)));
+
+static const size_t sizes[] = { 64, 256, 1024, 4096, 16384, MAXSIZE };
+
+static void
+bench_size(const char *suffix, size_t size, int n)
+{
+	char name[32];
+	uint64_t t;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		memcpy(dst, src, size);
+		cycles[i] = read_tsc() - t;
+	}
+	snprintf(name, sizeof(name), "memcpy_%d%s", size, suffix);
+	bench_report(name, cycles, n);
+
+	// Overlapping, so it has to copy backward
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		memmove(dst + 64, dst, size);
+		cycles[i] = read_tsc() - t;
+	}
+	snprintf(name, sizeof(name), "memmove_%d%s", size, suffix);
+	bench_report(name, cycles, n);
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		memset(dst, i, size);
+		cycles[i] = read_tsc() - t;
+	}
+	snprintf(name, sizeof(name), "memset_%d%s", size, suffix);
+	bench_report(name, cycles, n);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, n = bench_iters(argc, argv, 200);
+	int sse2 = string_sse2;
+
+	// Fault everything in first
+	memset(src, 1, sizeof(src));
+	memset(dst, 0, sizeof(dst));
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		string_sse2 = sse2;
+		bench_size("", sizes[i], n);
+		string_sse2 = 0;
+		bench_size("_rep", sizes[i], n);
+	}
+	string_sse2 = sse2;
+
+	if (!sse2)
+		cprintf("bench_memcpy: no SSE2, both rows use rep movs\n");
+	cprintf("bench: done\n");
+}
@@ -0,0 +1,41 @@
+// Time pipe throughput: a child writes n pages into a pipe, and we time
+// reading each one.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+static uint64_t cycles[BENCH_MAXITERS];
+static char buf[PGSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	int i, r, p[2], n = bench_iters(argc, argv, 100);
+	envid_t child;
+	uint64_t t;
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		close(p[0]);
+		for (i = 0; i < n; i++)
+			if ((r = write(p[1], buf, sizeof(buf))) != sizeof(buf))
+				panic("write: %e", r);
+		return;
+	}
+	close(p[1]);
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		if ((r = readn(p[0], buf, sizeof(buf))) != sizeof(buf))
+			panic("readn: %e", r);
+		cycles[i] = read_tsc() - t;
+	}
+	bench_report("pipe_4k", cycles, n);
+
+	close(p[0]);
+	wait(child);
+	cprintf("bench: done\n");
+}
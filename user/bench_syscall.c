@@ -0,0 +1,49 @@
+// Time the cheapest ways into the kernel: a system call the kernel
+// rejects at once, and sys_getenvid.  "rdtsc" is the cost of the
+// timing itself, included in every other result.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+static uint64_t cycles[BENCH_MAXITERS];
+
+static inline int
+null_syscall(void)
+{
+	int ret;
+
+	asm volatile("int %2"
+		     : "=a" (ret)
+		     : "a" (NSYSCALLS), "i" (T_SYSCALL)
+		     : "cc", "memory");
+	return ret;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, n = bench_iters(argc, argv, 1000);
+	uint64_t t;
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		cycles[i] = read_tsc() - t;
+	}
+	bench_report("rdtsc", cycles, n);
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		null_syscall();
+		cycles[i] = read_tsc() - t;
+	}
+	bench_report("null_syscall", cycles, n);
+
+	for (i = 0; i < n; i++) {
+		t = read_tsc();
+		sys_getenvid();
+		cycles[i] = read_tsc() - t;
+	}
+	bench_report("getenvid", cycles, n);
+
+	cprintf("bench: done\n");
+}
@@ -0,0 +1,49 @@
+// Print the kernel's trap and system call latencies, read straight
+// from the statistics mapped at UKSTATS.  With an argument, take two
+// samples that many milliseconds apart and print what happened in
+// between.
+
+#include <inc/lib.h>
+
+static struct Kstats before[KSTAT_NCPU], now[KSTAT_NCPU];
+
+// Subtract the counts in b from those in a.  The longest times cannot
+// be subtracted: a keeps the longest since boot, or the last reset.
+static void
+kstats_sub(struct KstatHist *a, const struct KstatHist *b)
+{
+	int i;
+
+	a->kh_count -= b->kh_count;
+	a->kh_cycles -= b->kh_cycles;
+	for (i = 0; i < KSTAT_NBUCKET; i++)
+		a->kh_bucket[i] -= b->kh_bucket[i];
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned end;
+	int cpu, i;
+
+	binaryname = "kstats";
+	if (argc < 2) {
+		kstats_print(kstats, KSTAT_NCPU);
+		return;
+	}
+
+	memcpy(before, (void *) kstats, sizeof(before));
+	end = sys_time_msec() + strtol(argv[1], 0, 0);
+	while (sys_time_msec() < end)
+		sys_yield();
+	memcpy(now, (void *) kstats, sizeof(now));
+
+	for (cpu = 0; cpu < KSTAT_NCPU; cpu++) {
+		for (i = 0; i < KSTAT_NTRAP; i++)
+			kstats_sub(&now[cpu].ks_trap[i], &before[cpu].ks_trap[i]);
+		for (i = 0; i < KSTAT_NSYSCALL; i++)
+			kstats_sub(&now[cpu].ks_syscall[i],
+				   &before[cpu].ks_syscall[i]);
+	}
+	kstats_print(now, KSTAT_NCPU);
+}
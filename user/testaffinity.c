@@ -0,0 +1,87 @@
+// Test that an environment pinned to a CPU with sys_env_set_affinity
+// only ever runs there, even when another CPU hands it a message with
+// ipc_call.  Needs at least two CPUs (CPUS=2).
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define ROUNDS	200
+
+// Check that we are running on CPU 'cpu', as we were pinned to.
+static void
+check_cpu(int cpu)
+{
+	if (thisenv->env_cpunum != cpu)
+		panic("pinned to CPU %d but ran on CPU %d",
+		      cpu, thisenv->env_cpunum);
+}
+
+// Pin ourselves to CPU 'cpu' and spin through the scheduler.
+static void
+spin_pinned(int cpu)
+{
+	int i, r;
+
+	if ((r = sys_env_set_affinity(0, 1 << cpu)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+	for (i = 0; i < ROUNDS; i++) {
+		sys_yield();
+		check_cpu(cpu);
+	}
+}
+
+// Answer ipc_calls on CPU 1 with the CPU we ran on.
+static void
+serve_pinned(void)
+{
+	envid_t from;
+	int r;
+
+	if ((r = sys_env_set_affinity(0, 1 << 1)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+	ipc_recv(&from, NULL, NULL);
+	while (1) {
+		check_cpu(1);
+		ipc_reply_wait(from, thisenv->env_cpunum, NULL, 0,
+			       &from, NULL, NULL);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+	envid_t kids[NCHILD], server;
+
+	if ((r = sys_env_set_affinity(0, 0)) != -E_INVAL)
+		panic("sys_env_set_affinity accepted an empty mask: %e", r);
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			spin_pinned(0);
+			exit();
+		}
+		kids[i] = r;
+	}
+	for (i = 0; i < NCHILD; i++)
+		wait(kids[i]);
+
+	// A call from CPU 0 must not pull the server onto CPU 0, even
+	// though the caller gives up its CPU to the server it calls.
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r == 0)
+		serve_pinned();
+	server = r;
+	if ((r = sys_env_set_affinity(0, 1 << 0)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+	for (i = 0; i < ROUNDS; i++) {
+		if ((r = ipc_call(server, i, NULL, 0, NULL, NULL)) != 1)
+			panic("pinned server ran on CPU %d", r);
+		check_cpu(0);
+	}
+	sys_env_destroy(server);
+	cprintf("pinned environments stay on their CPUs\n");
+}
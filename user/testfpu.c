@@ -0,0 +1,73 @@
+// Test that each environment keeps its own FPU and SSE registers
+// across context switches, and that fork gives the child a copy of
+// its parent's.
+
+#include <inc/lib.h>
+
+#define NCHILD	3
+#define ROUNDS	200
+
+// Load a set of registers distinctive of environment id.  xmm7 is one
+// that the SSE2 string routines leave alone.
+static void
+load(int id, uint32_t in[4], uint32_t *cw)
+{
+	int i;
+
+	*cw = 0x027f + (id << 10);
+	for (i = 0; i < 4; i++)
+		in[i] = 0x01010101 * (id + 1) + i;
+	asm volatile("movups %0, %%xmm7" : : "m" (*(uint32_t (*)[4]) in));
+	asm volatile("fldcw %0" : : "m" (*cw));
+}
+
+// Check that the registers are still those load(id) set.
+static void
+verify(int id, const uint32_t in[4], uint32_t cw, const char *when)
+{
+	uint32_t out[4], cwout;
+
+	asm volatile("movups %%xmm7, %0" : "=m" (out));
+	asm volatile("fnstcw %0" : "=m" (cwout));
+	if (memcmp(in, out, sizeof(out)) != 0 || (cwout & 0xfff) != (cw & 0xfff))
+		panic("environment %d lost its FPU registers %s", id, when);
+}
+
+static void
+check(int id)
+{
+	uint32_t in[4], cw;
+	int i;
+
+	load(id, in, &cw);
+	for (i = 0; i < ROUNDS; i++) {
+		sys_yield();
+		verify(id, in, cw, "across context switches");
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+	envid_t kids[NCHILD];
+	uint32_t in[4], cw;
+
+	// The children must start with these.
+	load(NCHILD + 1, in, &cw);
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			verify(NCHILD + 1, in, cw, "across fork");
+			check(i + 1);
+			exit();
+		}
+		kids[i] = r;
+	}
+	verify(NCHILD + 1, in, cw, "across fork");
+	check(0);
+	for (i = 0; i < NCHILD; i++)
+		wait(kids[i]);
+	cprintf("FPU registers survive context switches and fork\n");
+}
@@ -0,0 +1,35 @@
+// Test 4MB pages: allocation, copy-on-write fork, and unmapping.
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0xA0000000)
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, VA, PTE_P|PTE_W|PTE_U|PTE_PS)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if (!(uvpd[PDX(VA)] & PTE_PS))
+		panic("not mapped as a 4MB page");
+	VA[0] = 'a';
+	VA[PTSIZE - 1] = 'z';
+
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r == 0) {
+		VA[0] = 'b';
+		VA[PTSIZE - 1] = 'y';
+		exit();
+	}
+	wait(r);
+	if (VA[0] != 'a' || VA[PTSIZE - 1] != 'z')
+		panic("fork let the child write the parent's 4MB page");
+
+	if ((r = sys_page_unmap(0, VA + PGSIZE)) < 0)
+		panic("sys_page_unmap: %e", r);
+	if (uvpd[PDX(VA)] & PTE_P)
+		panic("unmap left part of the 4MB page mapped");
+	cprintf("4MB pages survive fork and unmap\n");
+}
@@ -0,0 +1,53 @@
+// Test that SCHED_FAIR environments share the CPU in proportion to
+// their weights.  Run it with one CPU (CPUS=1): with more, each child
+// may get a CPU of its own.
+
+#include <inc/lib.h>
+
+#define NCHILD	3
+#define RUNMS	1000
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+	envid_t kids[NCHILD];
+	uint64_t runtime[NCHILD];
+	unsigned now;
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0)
+			while (1)
+				/* spin */;
+		kids[i] = r;
+		if ((r = sys_env_set_sched(kids[i], SCHED_FAIR,
+					   SCHED_WEIGHT_DEFAULT << i)) < 0)
+			panic("sys_env_set_sched: %e", r);
+	}
+	if ((r = sys_env_set_sched(0, SCHED_RT, SCHED_WEIGHT_DEFAULT)) != -E_INVAL)
+		panic("sys_env_set_sched let a user environment become SCHED_RT: %e", r);
+
+	now = sys_time_msec();
+	while (sys_time_msec() < now + RUNMS)
+		sys_yield();
+
+	for (i = 0; i < NCHILD; i++) {
+		runtime[i] = envs[ENVX(kids[i])].env_runtime;
+		sys_env_destroy(kids[i]);
+	}
+	if (runtime[0] == 0)
+		panic("environment with weight %d never ran", SCHED_WEIGHT_DEFAULT);
+	for (i = 0; i < NCHILD; i++)
+		cprintf("weight %5d: %llu cycles, %u.%u times weight %d\n",
+			SCHED_WEIGHT_DEFAULT << i, runtime[i],
+			(unsigned) (runtime[i] * 10 / runtime[0]) / 10,
+			(unsigned) (runtime[i] * 10 / runtime[0]) % 10,
+			SCHED_WEIGHT_DEFAULT);
+	for (i = 1; i < NCHILD; i++)
+		if (runtime[i] <= runtime[i - 1])
+			panic("weight %d got no more time than weight %d",
+			      SCHED_WEIGHT_DEFAULT << i, SCHED_WEIGHT_DEFAULT << (i - 1));
+	cprintf("CPU time follows the weights\n");
+}